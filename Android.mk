@@ -6,13 +6,14 @@ system_zlib := y
 
 LOCAL_CFLAGS += -DRECOVERY_BUILD
 LOCAL_CFLAGS += -DWRITE_BOOTIMG
+LOCAL_CFLAGS += -DSYSTEM_MANIFEST
 LOCAL_LDFLAGS += -Wl,-dynamic-linker,/sbin/linker
 
 LOCAL_MODULE := update-binary
 LOCAL_SRC_FILES := src/main.c src/bootimg.c src/cpio.c src/override.c \
-	src/splash.c src/system.c src/zimage.c sfpng/src/sfpng.c \
-	sfpng/src/transform.c zlib/contrib/minizip/unzip.c \
-	zlib/contrib/minizip/ioapi.c
+	src/bdeflate.c src/lz4.c src/pdeflate.c src/splash.c src/system.c \
+	src/zimage.c src/zip.c \
+	sfpng/src/sfpng.c sfpng/src/transform.c
 
 ifneq ($(system_zlib),y)
 	LOCAL_SRC_FILES += zlib/adler32_vec.c zlib/crc32.c zlib/deflate.c \
@@ -22,7 +23,7 @@ endif
 
 LOCAL_CFLAGS += -O3 -s -fpie -flto -fno-fat-lto-objects -flto-partition=none \
 	-fdata-sections -ffunction-sections -I. -std=gnu11 -Wall \
-	-Wno-parentheses -pedantic -DIOAPI_NO_64
+	-Wno-parentheses -pedantic
 LOCAL_CFLAGS += -march=armv7-a -mtune=cortex-a15
 
 ifneq ($(system_zlib),y)
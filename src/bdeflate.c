@@ -0,0 +1,729 @@
+#include <unistd.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <sys/types.h>
+
+#include "common.h"
+#include "cpio.h"
+#include <zlib/zlib.h>
+
+/* Whole-buffer deflate, libdeflate-style:
+ * Since the entire cpio archive is in memory anyway, compress it in a single
+ * pass over one contiguous buffer rather than through zlib's sliding window.
+ * That buys us:
+ * - hash chains indexed by absolute position, with no window shuffling,
+ * - 4-byte hashing for long matches, plus a single-entry table for short,
+ *   nearby length-3 matches,
+ * - word-at-a-time match extension,
+ * - blocks ended where the literal/match statistics shift, rather than when
+ *   a fixed buffer fills,
+ * - per-block choice of dynamic, static or stored coding by exact cost.
+ * zlib is only used for crc32.
+ */
+#define BD_WSIZE (32768)
+#define BD_WMASK (BD_WSIZE - 1)
+#define BD_MAX_MATCH (258)
+#define BD_HASH4_BITS (15)
+#define BD_HASH3_BITS (12)
+#define BD_TOO_FAR (4096) /* length-3 matches further back cost too much */
+#define BD_CHAIN (24)
+#define BD_NICE (96)
+#define BD_NO_POS (-(1 << 30))
+
+/* Block splitting: after every BD_OBS_CHECK symbols, compare the recent
+ * symbol statistics against the block so far.
+ */
+#define BD_MAX_SYMS (32768)
+#define BD_MIN_BLOCK (10000)
+#define BD_MAX_BLOCK (300000)
+#define BD_OBS_CHECK (512)
+#define BD_OBS_TYPES (10)
+
+#define BD_NUM_LITLEN (288)
+#define BD_NUM_DIST (32)
+#define BD_NUM_CODELEN (19)
+#define BD_OUT_SZ (64*1024)
+
+static const uint16_t bd_len_base[29] = {
+	3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+	35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258,
+};
+static const uint8_t bd_len_extra[29] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+	3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0,
+};
+static const uint16_t bd_dist_base[30] = {
+	1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+	257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+	8193, 12289, 16385, 24577,
+};
+static const uint8_t bd_dist_extra[30] = {
+	0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+	7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13,
+};
+static const uint8_t bd_clen_order[BD_NUM_CODELEN] = {
+	16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15,
+};
+
+/* dist == 0 for literals */
+struct bd_sym {
+	uint16_t v;
+	uint16_t dist;
+};
+
+struct bdeflate {
+	/* Buffered input */
+	char *in;
+	unsigned long len, size;
+
+	/* Output, staged in obuf and handed to emit */
+	int (*emit)(const char *buf, unsigned long len);
+	unsigned long total;
+	uint8_t *out, *oend;
+	uint64_t bitbuf;
+	unsigned int bitcnt;
+	int err;
+	uint8_t obuf[BD_OUT_SZ];
+
+	/* Match finder */
+	int32_t head4[1 << BD_HASH4_BITS];
+	int32_t head3[1 << BD_HASH3_BITS];
+	int32_t prev[BD_WSIZE];
+
+	/* Current block */
+	struct bd_sym syms[BD_MAX_SYMS];
+	unsigned int nsyms;
+	uint32_t litlen_freq[BD_NUM_LITLEN];
+	uint32_t dist_freq[BD_NUM_DIST];
+	uint32_t obs[BD_OBS_TYPES], new_obs[BD_OBS_TYPES];
+	uint32_t nobs, nnew_obs;
+
+	/* Codes */
+	uint8_t litlen_lens[BD_NUM_LITLEN], dist_lens[BD_NUM_DIST];
+	uint16_t litlen_codes[BD_NUM_LITLEN], dist_codes[BD_NUM_DIST];
+	uint8_t len_slot[BD_MAX_MATCH + 1];
+	uint8_t dist_slot[512];
+};
+
+static inline uint32_t bd_load32(const uint8_t *p) {
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+static inline uint32_t bd_hash4(uint32_t v) {
+	return (v * 0x1e35a7bdU) >> (32 - BD_HASH4_BITS);
+}
+static inline uint32_t bd_hash3(const uint8_t *p) {
+	return ((p[0] | (p[1] << 8) | (p[2] << 16)) * 0x1e35a7bdU) >>
+		(32 - BD_HASH3_BITS);
+}
+static inline unsigned int bd_dist_slot(struct bdeflate *bd, unsigned int d) {
+	d--;
+	return d < 256 ? bd->dist_slot[d] : bd->dist_slot[256 + (d >> 7)];
+}
+
+/* Compare a word at a time; the first differing byte is found from the
+ * lowest set bit, so this needs a little-endian CPU.
+ */
+static inline unsigned int bd_match_len(const uint8_t *a, const uint8_t *b,
+		unsigned int len, unsigned int max) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	unsigned long x, y;
+
+	while (len + sizeof(x) <= max) {
+		memcpy(&x, a + len, sizeof(x));
+		memcpy(&y, b + len, sizeof(y));
+		if (x != y)
+			return len + (__builtin_ctzl(x ^ y) >> 3);
+		len += sizeof(x);
+	}
+#endif
+	while (len < max && a[len] == b[len])
+		len++;
+	return len;
+}
+
+/* bit output
+ * The first error from emit sticks; later output is dropped.
+ */
+static void bd_drain(struct bdeflate *bd) {
+	unsigned long n = bd->out - bd->obuf;
+
+	if (!bd->err && n)
+		bd->err = bd->emit((char *)bd->obuf, n);
+	bd->total += n;
+	bd->out = bd->obuf;
+}
+static inline void bd_put(struct bdeflate *bd, uint32_t bits, unsigned int n) {
+	bd->bitbuf |= (uint64_t)bits << bd->bitcnt;
+	bd->bitcnt += n;
+	if (bd->bitcnt >= 32) {
+		if (bd->oend - bd->out < 4)
+			bd_drain(bd);
+		bd->out[0] = bd->bitbuf;
+		bd->out[1] = bd->bitbuf >> 8;
+		bd->out[2] = bd->bitbuf >> 16;
+		bd->out[3] = bd->bitbuf >> 24;
+		bd->out += 4;
+		bd->bitbuf >>= 32;
+		bd->bitcnt -= 32;
+	}
+}
+static void bd_put_bytes(struct bdeflate *bd, const void *buf,
+		unsigned long len) {
+	const uint8_t *p = buf;
+	unsigned long n;
+
+	while (len) {
+		if (bd->out == bd->oend)
+			bd_drain(bd);
+		n = bd->oend - bd->out;
+		if (n > len)
+			n = len;
+		memcpy(bd->out, p, n);
+		bd->out += n;
+		p += n;
+		len -= n;
+	}
+}
+/* Pad to a byte boundary and drain the bit buffer */
+static void bd_align(struct bdeflate *bd) {
+	uint8_t c;
+
+	bd_put(bd, 0, (8 - (bd->bitcnt & 7)) & 7);
+	while (bd->bitcnt) {
+		c = bd->bitbuf;
+		bd_put_bytes(bd, &c, 1);
+		bd->bitbuf >>= 8;
+		bd->bitcnt -= 8;
+	}
+}
+
+/* Huffman codes
+ * Code lengths are computed in place with Moffat and Katajainen's algorithm
+ * over the symbols sorted by frequency, then limited to max_len by pushing
+ * the deepest codes up and splitting shorter ones, as miniz does.
+ */
+struct bd_freq {
+	uint32_t key;
+	uint16_t sym;
+};
+static int bd_freq_cmp(const void *a, const void *b) {
+	const struct bd_freq *x = a, *y = b;
+	if (x->key != y->key)
+		return x->key < y->key ? -1 : 1;
+	return x->sym - y->sym;
+}
+static void bd_min_redundancy(struct bd_freq *a, int n) {
+	int root, leaf, next, avbl, used, dpth;
+
+	a[0].key += a[1].key;
+	root = 0;
+	leaf = 2;
+	for (next = 1; next < n - 1; next++) {
+		if (leaf >= n || a[root].key < a[leaf].key) {
+			a[next].key = a[root].key;
+			a[root++].key = next;
+		} else {
+			a[next].key = a[leaf++].key;
+		}
+		if (leaf >= n || (root < next && a[root].key < a[leaf].key)) {
+			a[next].key += a[root].key;
+			a[root++].key = next;
+		} else {
+			a[next].key += a[leaf++].key;
+		}
+	}
+	a[n - 2].key = 0;
+	for (next = n - 3; next >= 0; next--)
+		a[next].key = a[a[next].key].key + 1;
+	avbl = 1;
+	used = dpth = 0;
+	root = n - 2;
+	next = n - 1;
+	while (avbl > 0) {
+		while (root >= 0 && (int)a[root].key == dpth) {
+			used++;
+			root--;
+		}
+		while (avbl > used) {
+			a[next--].key = dpth;
+			avbl--;
+		}
+		avbl = 2 * used;
+		dpth++;
+		used = 0;
+	}
+}
+static void bd_make_lengths(const uint32_t *freq, unsigned int n,
+		unsigned int max_len, uint8_t *lens) {
+	struct bd_freq a[BD_NUM_LITLEN];
+	unsigned int cnt[64] = { 0 };
+	unsigned int i, j, l, used = 0;
+	uint32_t total;
+
+	memset(lens, 0, n);
+	for (i = 0; i < n; i++) {
+		if (freq[i]) {
+			a[used].key = freq[i];
+			a[used++].sym = i;
+		}
+	}
+	/* Decoders are happiest with at least two codes */
+	for (i = 0; used < 2; i++) {
+		if (!freq[i]) {
+			a[used].key = 1;
+			a[used++].sym = i;
+		}
+	}
+	qsort(a, used, sizeof(struct bd_freq), bd_freq_cmp);
+	bd_min_redundancy(a, used);
+
+	for (i = 0; i < used; i++)
+		cnt[a[i].key < 64 ? a[i].key : 63]++;
+	for (i = max_len + 1; i < 64; i++) {
+		cnt[max_len] += cnt[i];
+		cnt[i] = 0;
+	}
+	for (total = 0, i = max_len; i > 0; i--)
+		total += cnt[i] << (max_len - i);
+	while (total != 1U << max_len) {
+		cnt[max_len]--;
+		for (i = max_len - 1; i > 0; i--) {
+			if (cnt[i]) {
+				cnt[i]--;
+				cnt[i + 1] += 2;
+				break;
+			}
+		}
+		total--;
+	}
+
+	/* The shortest codes go to the most frequent symbols */
+	for (j = used, l = 1; l <= max_len; l++)
+		for (i = cnt[l]; i; i--)
+			lens[a[--j].sym] = l;
+}
+/* Canonical codes, bit-reversed for LSB-first output */
+static void bd_make_codes(const uint8_t *lens, unsigned int n,
+		uint16_t *codes) {
+	unsigned int cnt[16] = { 0 }, next[16];
+	unsigned int i, l, c, r, code = 0;
+
+	for (i = 0; i < n; i++)
+		cnt[lens[i]]++;
+	cnt[0] = 0;
+	for (l = 1; l < 16; l++) {
+		code = (code + cnt[l - 1]) << 1;
+		next[l] = code;
+	}
+	for (i = 0; i < n; i++) {
+		if (!(l = lens[i])) {
+			codes[i] = 0;
+			continue;
+		}
+		for (c = next[l]++, r = 0; l--; c >>= 1)
+			r = (r << 1) | (c & 1);
+		codes[i] = r;
+	}
+}
+static void bd_static_lens(struct bdeflate *bd) {
+	unsigned int i;
+
+	for (i = 0; i < 144; i++)
+		bd->litlen_lens[i] = 8;
+	for (; i < 256; i++)
+		bd->litlen_lens[i] = 9;
+	for (; i < 280; i++)
+		bd->litlen_lens[i] = 7;
+	for (; i < BD_NUM_LITLEN; i++)
+		bd->litlen_lens[i] = 8;
+	for (i = 0; i < BD_NUM_DIST; i++)
+		bd->dist_lens[i] = 5;
+}
+
+/* Run-length encode code lengths with the 16/17/18 repeat codes */
+static unsigned int bd_rle_lens(const uint8_t *lens, unsigned int n,
+		uint8_t *sym, uint8_t *extra, uint32_t *freq) {
+	unsigned int i, run, left, r, cnt = 0;
+
+#define BD_RLE(s, x) do { \
+	sym[cnt] = (s); \
+	extra[cnt++] = (x); \
+	freq[s]++; \
+} while (0)
+	for (i = 0; i < n; i += run) {
+		for (run = 1; i + run < n && lens[i + run] == lens[i]; run++);
+		left = run;
+		if (!lens[i]) {
+			for (; left >= 11; left -= r) {
+				r = left < 138 ? left : 138;
+				BD_RLE(18, r - 11);
+			}
+			if (left >= 3) {
+				BD_RLE(17, left - 3);
+				left = 0;
+			}
+		} else if (left >= 4) {
+			BD_RLE(lens[i], 0);
+			for (left--; left >= 3; left -= r) {
+				r = left < 6 ? left : 6;
+				BD_RLE(16, r - 3);
+			}
+		}
+		for (; left; left--)
+			BD_RLE(lens[i], 0);
+	}
+#undef BD_RLE
+	return cnt;
+}
+
+static void bd_write_syms(struct bdeflate *bd) {
+	struct bd_sym *s, *end = bd->syms + bd->nsyms;
+	unsigned int slot;
+
+	for (s = bd->syms; s < end; s++) {
+		if (!s->dist) {
+			bd_put(bd, bd->litlen_codes[s->v],
+				bd->litlen_lens[s->v]);
+			continue;
+		}
+		slot = bd->len_slot[s->v];
+		bd_put(bd, bd->litlen_codes[257 + slot],
+			bd->litlen_lens[257 + slot]);
+		bd_put(bd, s->v - bd_len_base[slot], bd_len_extra[slot]);
+		slot = bd_dist_slot(bd, s->dist);
+		bd_put(bd, bd->dist_codes[slot], bd->dist_lens[slot]);
+		bd_put(bd, s->dist - bd_dist_base[slot], bd_dist_extra[slot]);
+	}
+	bd_put(bd, bd->litlen_codes[256], bd->litlen_lens[256]);
+}
+
+/* bd_flush_block:
+ * Emit the pending symbols, covering blk_len bytes of input at blk, as
+ * whichever block type is cheapest.
+ */
+static void bd_flush_block(struct bdeflate *bd, const uint8_t *blk,
+		unsigned long blk_len, int final) {
+	uint8_t all[BD_NUM_LITLEN + BD_NUM_DIST];
+	uint8_t rle_sym[BD_NUM_LITLEN + BD_NUM_DIST];
+	uint8_t rle_extra[BD_NUM_LITLEN + BD_NUM_DIST];
+	uint32_t clen_freq[BD_NUM_CODELEN] = { 0 };
+	uint8_t clen_lens[BD_NUM_CODELEN];
+	uint16_t clen_codes[BD_NUM_CODELEN];
+	unsigned int nlit, ndist, nclen, nrle, i, n;
+	uint64_t dyn, fix, stored, extra = 0;
+	static const uint8_t clen_extra[BD_NUM_CODELEN] = {
+		[16] = 2, [17] = 3, [18] = 7,
+	};
+
+	bd->litlen_freq[256]++;
+	bd_make_lengths(bd->litlen_freq, 286, 15, bd->litlen_lens);
+	bd_make_lengths(bd->dist_freq, 30, 15, bd->dist_lens);
+	for (nlit = 286; nlit > 257 && !bd->litlen_lens[nlit - 1]; nlit--);
+	for (ndist = 30; ndist > 1 && !bd->dist_lens[ndist - 1]; ndist--);
+	memcpy(all, bd->litlen_lens, nlit);
+	memcpy(all + nlit, bd->dist_lens, ndist);
+	nrle = bd_rle_lens(all, nlit + ndist, rle_sym, rle_extra, clen_freq);
+	bd_make_lengths(clen_freq, BD_NUM_CODELEN, 7, clen_lens);
+	for (nclen = BD_NUM_CODELEN; nclen > 4 &&
+		!clen_lens[bd_clen_order[nclen - 1]]; nclen--);
+
+	/* Costs, in bits */
+	for (i = 0; i < 29; i++)
+		extra += (uint64_t)bd->litlen_freq[257 + i] * bd_len_extra[i];
+	for (i = 0; i < 30; i++)
+		extra += (uint64_t)bd->dist_freq[i] * bd_dist_extra[i];
+	dyn = 5 + 5 + 4 + 3 * nclen + extra;
+	for (i = 0; i < BD_NUM_CODELEN; i++)
+		dyn += clen_freq[i] * (clen_lens[i] + clen_extra[i]);
+	for (i = 0; i < 286; i++)
+		dyn += (uint64_t)bd->litlen_freq[i] * bd->litlen_lens[i];
+	for (i = 0; i < 30; i++)
+		dyn += (uint64_t)bd->dist_freq[i] * bd->dist_lens[i];
+	fix = extra;
+	for (i = 0; i < 286; i++)
+		fix += (uint64_t)bd->litlen_freq[i] *
+			(i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8);
+	for (i = 0; i < 30; i++)
+		fix += (uint64_t)bd->dist_freq[i] * 5;
+	stored = (blk_len / 65535 + 1) * 40 + (uint64_t)blk_len * 8;
+
+	if (stored < dyn && stored < fix) {
+		do {
+			n = blk_len > 65535 ? 65535 : blk_len;
+			bd_put(bd, final && n == blk_len, 1);
+			bd_put(bd, 0, 2);
+			bd_align(bd);
+			bd_put(bd, n | (~n << 16), 32);
+			bd_align(bd);
+			bd_put_bytes(bd, blk, n);
+			blk += n;
+			blk_len -= n;
+		} while (blk_len);
+	} else if (fix <= dyn) {
+		bd_static_lens(bd);
+		bd_make_codes(bd->litlen_lens, BD_NUM_LITLEN, bd->litlen_codes);
+		bd_make_codes(bd->dist_lens, BD_NUM_DIST, bd->dist_codes);
+		bd_put(bd, final | (1 << 1), 3);
+		bd_write_syms(bd);
+	} else {
+		/* Only the symbols given lengths above; the last two litlen and
+		 * dist slots still hold whatever was there before
+		 */
+		bd_make_codes(bd->litlen_lens, 286, bd->litlen_codes);
+		bd_make_codes(bd->dist_lens, 30, bd->dist_codes);
+		bd_make_codes(clen_lens, BD_NUM_CODELEN, clen_codes);
+		bd_put(bd, final | (2 << 1), 3);
+		bd_put(bd, nlit - 257, 5);
+		bd_put(bd, ndist - 1, 5);
+		bd_put(bd, nclen - 4, 4);
+		for (i = 0; i < nclen; i++)
+			bd_put(bd, clen_lens[bd_clen_order[i]], 3);
+		for (i = 0; i < nrle; i++) {
+			bd_put(bd, clen_codes[rle_sym[i]], clen_lens[rle_sym[i]]);
+			bd_put(bd, rle_extra[i], clen_extra[rle_sym[i]]);
+		}
+		bd_write_syms(bd);
+	}
+
+	bd->nsyms = 0;
+	memset(bd->litlen_freq, 0, sizeof(bd->litlen_freq));
+	memset(bd->dist_freq, 0, sizeof(bd->dist_freq));
+	memset(bd->obs, 0, sizeof(bd->obs));
+	memset(bd->new_obs, 0, sizeof(bd->new_obs));
+	bd->nobs = bd->nnew_obs = 0;
+}
+
+static inline void bd_literal(struct bdeflate *bd, uint8_t c) {
+	bd->syms[bd->nsyms].v = c;
+	bd->syms[bd->nsyms++].dist = 0;
+	bd->litlen_freq[c]++;
+	bd->new_obs[((c >> 5) & 6) | (c & 1)]++;
+	bd->nnew_obs++;
+}
+static inline void bd_match(struct bdeflate *bd, unsigned int len,
+		unsigned int dist) {
+	bd->syms[bd->nsyms].v = len;
+	bd->syms[bd->nsyms++].dist = dist;
+	bd->litlen_freq[257 + bd->len_slot[len]]++;
+	bd->dist_freq[bd_dist_slot(bd, dist)]++;
+	bd->new_obs[8 + (len >= 9)]++;
+	bd->nnew_obs++;
+}
+
+/* Has the symbol mix drifted far enough from the rest of the block to be
+ * worth a new set of codes?  Thresholds follow libdeflate.
+ */
+static int bd_split_here(struct bdeflate *bd, unsigned long blk_len,
+		unsigned long left) {
+	uint64_t delta = 0, expect, actual, cutoff;
+	unsigned int i;
+
+	if (bd->nnew_obs < BD_OBS_CHECK || blk_len < BD_MIN_BLOCK ||
+		left < BD_MIN_BLOCK)
+		return 0;
+
+	if (bd->nobs) {
+		for (i = 0; i < BD_OBS_TYPES; i++) {
+			expect = (uint64_t)bd->obs[i] * bd->nnew_obs;
+			actual = (uint64_t)bd->new_obs[i] * bd->nobs;
+			delta += actual > expect ? actual - expect :
+				expect - actual;
+		}
+		cutoff = (uint64_t)bd->nnew_obs * 200 / 512 * bd->nobs;
+		if (delta + (blk_len / 4096) * bd->nobs >= cutoff)
+			return 1;
+	}
+
+	for (i = 0; i < BD_OBS_TYPES; i++) {
+		bd->obs[i] += bd->new_obs[i];
+		bd->new_obs[i] = 0;
+	}
+	bd->nobs += bd->nnew_obs;
+	bd->nnew_obs = 0;
+	return 0;
+}
+
+/* Match finder: hash chains over absolute positions */
+static inline void bd_insert(struct bdeflate *bd, const uint8_t *in,
+		unsigned long p) {
+	uint32_t h = bd_hash4(bd_load32(in + p));
+
+	bd->prev[p & BD_WMASK] = bd->head4[h];
+	bd->head4[h] = p;
+	bd->head3[bd_hash3(in + p)] = p;
+}
+static unsigned int bd_find(struct bdeflate *bd, const uint8_t *in,
+		unsigned long p, unsigned long len, unsigned int *dist) {
+	const uint8_t *cur = in + p, *m;
+	long cutoff = (long)p - BD_WSIZE;
+	unsigned int max, best = 0, depth = BD_CHAIN, l;
+	uint32_t v = bd_load32(cur);
+	int32_t cand;
+
+	max = len - p < BD_MAX_MATCH ? len - p : BD_MAX_MATCH;
+	for (cand = bd->head4[bd_hash4(v)]; cand > cutoff && depth--;
+		cand = bd->prev[cand & BD_WMASK]) {
+		m = in + cand;
+		if (bd_load32(m) != v || (best && m[best] != cur[best]))
+			continue;
+		l = bd_match_len(m, cur, 4, max);
+		if (l > best) {
+			best = l;
+			*dist = p - cand;
+			if (l >= BD_NICE || l == max)
+				break;
+		}
+	}
+	if (best < 3) {
+		cand = bd->head3[bd_hash3(cur)];
+		m = in + cand;
+		if (cand > (long)p - BD_TOO_FAR && m[0] == cur[0] &&
+			m[1] == cur[1] && m[2] == cur[2]) {
+			best = 3;
+			*dist = p - cand;
+		}
+	}
+	return best;
+}
+
+/* bd_compress:
+ * Lazy matching, as in zlib's deflate_slow: take a match at p only if p + 1
+ * doesn't have a longer one.
+ */
+static void bd_compress(struct bdeflate *bd, const uint8_t *in,
+		unsigned long len) {
+	unsigned long p = 0, blk = 0, ins = 0, q;
+	unsigned int cur, next, dist, next_dist;
+
+	for (q = 0; q < (1 << BD_HASH4_BITS); q++)
+		bd->head4[q] = BD_NO_POS;
+	for (q = 0; q < (1 << BD_HASH3_BITS); q++)
+		bd->head3[q] = BD_NO_POS;
+
+	while (p < len) {
+		if (bd->nsyms >= BD_MAX_SYMS - BD_MAX_MATCH ||
+			p - blk >= BD_MAX_BLOCK ||
+			bd_split_here(bd, p - blk, len - p)) {
+			bd_flush_block(bd, in + blk, p - blk, 0);
+			blk = p;
+		}
+
+		if (len - p < 4) {
+			bd_literal(bd, in[p++]);
+			continue;
+		}
+
+		cur = bd_find(bd, in, p, len, &dist);
+		bd_insert(bd, in, p);
+		ins = p + 1;
+		while (cur >= 3 && cur < BD_NICE && len - p > 4) {
+			next = bd_find(bd, in, p + 1, len, &next_dist);
+			bd_insert(bd, in, p + 1);
+			ins = p + 2;
+			if (next <= cur)
+				break;
+			bd_literal(bd, in[p++]);
+			cur = next;
+			dist = next_dist;
+		}
+
+		if (cur < 3) {
+			bd_literal(bd, in[p++]);
+			continue;
+		}
+		bd_match(bd, cur, dist);
+		for (q = ins; q < p + cur && len - q >= 4; q++)
+			bd_insert(bd, in, q);
+		p += cur;
+	}
+
+	bd_flush_block(bd, in + blk, p - blk, 1);
+	bd_align(bd);
+}
+
+/* bdeflate_init:
+ * Set up a compressor that buffers all its input, then hands a gzip stream to
+ * emit in one go.
+ */
+struct bdeflate *bdeflate_init(int (*emit)(const char *buf,
+		unsigned long len)) {
+	struct bdeflate *bd;
+	unsigned int i, j;
+
+	if (!(bd = malloc(sizeof(struct bdeflate))))
+		return NULL;
+	bd->in = NULL;
+	bd->len = bd->size = 0;
+	bd->emit = emit;
+
+	for (i = 0; i < 29; i++)
+		for (j = bd_len_base[i]; j < bd_len_base[i] +
+			(1 << bd_len_extra[i]) && j <= BD_MAX_MATCH; j++)
+			bd->len_slot[j] = i;
+	for (i = 0; i < 30; i++) {
+		for (j = bd_dist_base[i] - 1; j < bd_dist_base[i] - 1 +
+			(1 << bd_dist_extra[i]); j++) {
+			if (j < 256)
+				bd->dist_slot[j] = i;
+			else
+				bd->dist_slot[256 + (j >> 7)] = i;
+		}
+	}
+	return bd;
+}
+
+/* bdeflate_write:
+ * Append to the input buffer.
+ */
+int bdeflate_write(struct bdeflate *bd, const char *buf, unsigned long len) {
+	unsigned long size;
+	char *n;
+
+	if (bd->size - bd->len < len) {
+		for (size = bd->size ? bd->size : 1 << 20;
+			size - bd->len < len; size *= 2);
+		if (!(n = realloc(bd->in, size)))
+			return -ENOMEM;
+		bd->in = n;
+		bd->size = size;
+	}
+	memcpy(bd->in + bd->len, buf, len);
+	bd->len += len;
+	return 0;
+}
+
+/* bdeflate_finish:
+ * Compress everything buffered, wrapped in a gzip header and trailer.
+ * Returns the compressed size, or -errno.
+ */
+long bdeflate_finish(struct bdeflate *bd) {
+	static const uint8_t gzip_hdr[10] = { 0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3 };
+	long ret;
+
+	bd->out = bd->obuf;
+	bd->oend = bd->obuf + BD_OUT_SZ;
+	bd->total = 0;
+	bd->bitbuf = 0;
+	bd->bitcnt = 0;
+	bd->err = 0;
+	bd->nsyms = 0;
+	memset(bd->litlen_freq, 0, sizeof(bd->litlen_freq));
+	memset(bd->dist_freq, 0, sizeof(bd->dist_freq));
+	memset(bd->obs, 0, sizeof(bd->obs));
+	memset(bd->new_obs, 0, sizeof(bd->new_obs));
+	bd->nobs = bd->nnew_obs = 0;
+
+	bd_put_bytes(bd, gzip_hdr, sizeof(gzip_hdr));
+	bd_compress(bd, (uint8_t *)bd->in, bd->len);
+	bd_put(bd, crc32(0, (uint8_t *)bd->in, bd->len), 32);
+	bd_put(bd, bd->len, 32);
+	bd_drain(bd);
+
+	ret = bd->err ? bd->err : bd->total;
+	free(bd->in);
+	free(bd);
+	return ret;
+}
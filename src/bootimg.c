@@ -4,6 +4,7 @@
 #include <fcntl.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
 #include <pthread.h>
 #include <sys/types.h>
 #include <sys/ioctl.h>
@@ -20,39 +21,77 @@ static char *zimage = NULL;
 static char *ramdisk = NULL;
 static unsigned int zimage_size = 0, ramdisk_size = 0;
 
-/* No need for locks here */
-int add_ramdisk(void *buf, unsigned int size) {
-	if (ramdisk) return -EBUSY;
-	ramdisk = buf;
-	ramdisk_size = size;
+/* What's already on the partition, for skipping redundant writes.  The old
+ * ramdisk buffer belongs to us, not get_ramdisk's caller.
+ */
+static struct boot_img_hdr old_hdr;
+static int old_hdr_off = -1;
+static char *old_ramdisk = NULL;
+
+/* The partition is opened once and shared by the zImage and ramdisk threads;
+ * everything goes through pread/pwrite.  zimage_ret is 1 until the zImage's
+ * size is known (or unpacking failed), since that decides where the ramdisk
+ * goes.  old_read is 0 until get_ramdisk has read the old ramdisk (or
+ * failed to), and zimage_early is the pages add_zimage wrote over the old
+ * kernel, or -errno, once zimage_early_done is set.
+ */
+static pthread_mutex_t boot_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t boot_cond = PTHREAD_COND_INITIALIZER;
+static int bootfd = -1;
+static uint64_t szlim;
+static int zimage_ret = 1;
+static int old_read = 0;
+static int zimage_early = 0, zimage_early_done = 0;
+
+/* Call with boot_lock held */
+static int boot_open(void) {
+#ifdef RECOVERY_BUILD
+	int ret;
+
+	if (bootfd >= 0)
+		return 0;
+	bootfd = open(BOOTPART, O_RDWR);
+	if (bootfd < 0) return -errno;
+	if (ioctl(bootfd, BLKGETSIZE64, &szlim)) {
+		ret = -errno;
+		close(bootfd);
+		bootfd = -1;
+		return ret;
+	}
+#else
+	if (bootfd >= 0)
+		return 0;
+	bootfd = open(bootimg_path, O_RDWR);
+	if (bootfd < 0) return -errno;
+	szlim = 10 << 20;
+#endif
 	return 0;
 }
-int add_zimage(void *buf, unsigned int size) {
-	if (zimage) return -EBUSY;
-	zimage = buf;
-	zimage_size = size;
-	return 0;
+
+static int delta_write(int fd, off_t off, const char *buf, unsigned int len);
+
+static unsigned int old_ramdisk_pos(void) {
+	unsigned int pos = old_hdr.page_size + old_hdr.kernel_size;
+	if (pos % old_hdr.page_size)
+		pos += old_hdr.page_size - (pos % old_hdr.page_size);
+	return pos;
 }
 
 int get_ramdisk(char **rdbuf) {
 	char *hdrbuf;
-	int fd, rd, sz, ret = 0;
+	int rd, sz, ret = 0;
 	if (!(hdrbuf = malloc(1024))) return -ENOMEM;
-#ifdef RECOVERY_BUILD
-	fd = open(BOOTPART, O_RDONLY);
-#else
-	fd = open(bootimg_path, O_RDONLY);
-#endif
-	if (fd < 0) {
-		ret = -errno;
+	pthread_mutex_lock(&boot_lock);
+	ret = boot_open();
+	pthread_mutex_unlock(&boot_lock);
+	if (ret)
 		goto out;
-	}
-	rd = read(fd, hdrbuf, 1024);
+	rd = pread(bootfd, hdrbuf, 1024, 0);
 	if (rd < 0) {
 		ret = -errno;
 		goto out;
 	}
-	for (sz = 0; sz + sizeof(struct boot_img_hdr) < 1024; sz++) {
+	for (sz = 0; sz + sizeof(struct boot_img_hdr) < rd; sz++) {
 		if (!memcmp(&hdrbuf[sz], BOOT_MAGIC, BOOT_MAGIC_SIZE))
 			goto found;
 	}
@@ -61,125 +100,445 @@ int get_ramdisk(char **rdbuf) {
 
 found:
 	memcpy(&boot_hdr, &hdrbuf[sz], sizeof(struct boot_img_hdr));
+	memcpy(&old_hdr, &boot_hdr, sizeof(struct boot_img_hdr));
+	old_hdr_off = sz;
 	rd = boot_hdr.page_size + boot_hdr.kernel_size;
 	if (rd % boot_hdr.page_size)
 		rd += boot_hdr.page_size - (rd % boot_hdr.page_size);
-	if (lseek(fd, rd, SEEK_SET) == -1) {
-		ret = -errno;
-		goto out;
-	}
 	if (!(*rdbuf = malloc(boot_hdr.ramdisk_size))) {
 		ret = -ENOMEM;
 		goto out;
 	}
-	for (sz = 0; sz < boot_hdr.ramdisk_size; sz += rd) {
-		rd = read(fd, *rdbuf + sz, boot_hdr.ramdisk_size - sz);
-		if (rd < 0) {
+	for (sz = 0; sz < boot_hdr.ramdisk_size; sz += ret) {
+		ret = pread(bootfd, *rdbuf + sz, boot_hdr.ramdisk_size - sz,
+			rd + sz);
+		if (ret <= 0) {
 			free(*rdbuf);
 			*rdbuf = NULL;
 			ret = -EIO;
 			goto out;
 		}
 	}
+	old_ramdisk = *rdbuf;
 	ret = boot_hdr.ramdisk_size;
 out:
 	free(hdrbuf);
+	pthread_mutex_lock(&boot_lock);
+	old_read = ret < 0 ? ret : 1;
+	pthread_cond_broadcast(&boot_cond);
+	pthread_mutex_unlock(&boot_lock);
 	return ret;
 }
 
-int generate_bootimg(void) {
-	int ret, bootfd;
-#ifdef WRITE_BOOTIMG
-	int wr;
-#endif
-	int pos;
-	uint64_t szlim;
+/* Where the old ramdisk and second stage end.  Until the new ramdisk is
+ * done, nothing from old_ramdisk_pos up to here is written, so a failed
+ * ramdisk leaves the old one in place.  The old kernel below it may be
+ * written once get_ramdisk has read the old ramdisk.
+ */
+static unsigned long old_image_end(void) {
+	unsigned long end = old_ramdisk_pos() + old_hdr.ramdisk_size;
+	if (end % old_hdr.page_size)
+		end += old_hdr.page_size - (end % old_hdr.page_size);
+	return end + old_hdr.second_size;
+}
+static int old_image_overlaps(unsigned long off, unsigned long len) {
+	return off < old_image_end() && off + len > old_ramdisk_pos();
+}
 
-	/* Extracting the zImage should be done first */
-	if (ret = wait_thread(THREAD_ZIMAGE)) return ret;
-	/* Make sure ramdisk patching is successful before wiping out the
-	 * existing image.
-	 */
-	if (ret = wait_thread(THREAD_RAMDISK)) return ret;
+/* How much of the zImage only covers the old kernel */
+static unsigned int zimage_early_len(void) {
+	unsigned int keep = old_ramdisk_pos();
 
-	rprint("Writing boot.img");
-#ifdef RECOVERY_BUILD
-	bootfd = open(BOOTPART, O_RDWR);
-	if (!bootfd) return -errno;
-	if (ioctl(bootfd, BLKGETSIZE64, &szlim)) return -errno;
-#else
-	printf("%s: %i @ %p, %i @ %p\n", __func__,
-		zimage_size, zimage,
-		ramdisk_size, ramdisk);
-	bootfd = open(bootimg_path, O_RDWR);
-	if (!bootfd) return -errno;
-	szlim = 10 << 20;
-#endif
+	if (keep <= PGSZ)
+		return 0;
+	return zimage_size < keep - PGSZ ? zimage_size : keep - PGSZ;
+}
 
-	if (zimage_size + ramdisk_size + PGSZ * 3 > szlim) {
-		rprint("Ramdisk is too big!");
-		ret = -ENOSPC;
-		goto ramdisk_close;
-	}
+/* add_zimage:
+ * The zImage always lives at PGSZ, overwriting the old one.  Once it's
+ * checked and published, a ramdisk waiting on its size is woken (a NULL buf
+ * means unpacking failed), and whatever of it only covers the old kernel is
+ * written as soon as get_ramdisk has read the old ramdisk.  add_ramdisk
+ * writes the rest.  buf must stay valid until then.
+ */
+int add_zimage(void *buf, unsigned int size) {
+	int ret = 0, old;
 
-	if (zimage_size + PGSZ * 3 > szlim) {
+	pthread_mutex_lock(&boot_lock);
+	if (zimage) {
+		pthread_mutex_unlock(&boot_lock);
+		return -EBUSY;
+	}
+	if (!buf)
+		ret = -ENOENT;
+	else if (!(ret = boot_open()) && size + PGSZ * 3 > szlim) {
 		rprint("zImage is too big!");
 		ret = -ENOSPC;
-		goto ramdisk_close;
 	}
-	if (lseek(bootfd, PGSZ, SEEK_SET) == -1) {
-		rprint("zImage seek failed!");
-		ret = -errno;
-		goto ramdisk_close;
+	if (!ret) {
+		zimage = buf;
+		zimage_size = size;
 	}
-#ifdef WRITE_BOOTIMG
-	for (pos = 0; pos < zimage_size; pos += wr) {
-		wr = write(bootfd, zimage + pos, zimage_size - pos);
-		if (wr < 0) {
+	zimage_ret = ret;
+	pthread_cond_broadcast(&boot_cond);
+	while (!ret && !old_read)
+		pthread_cond_wait(&boot_cond, &boot_lock);
+	old = old_read;
+	pthread_mutex_unlock(&boot_lock);
+	if (ret)
+		return ret;
+
+	/* Without the old ramdisk there's no install to make room for */
+	if (old > 0 && zimage_early_len() &&
+		(ret = delta_write(bootfd, PGSZ, zimage, zimage_early_len())) < 0)
+		rprint("Writing zImage failed!");
+
+	pthread_mutex_lock(&boot_lock);
+	zimage_early = ret;
+	zimage_early_done = 1;
+	pthread_cond_broadcast(&boot_cond);
+	pthread_mutex_unlock(&boot_lock);
+	return ret < 0 ? ret : 0;
+}
+
+/* zimage_commit:
+ * Write the part of the zImage over the old ramdisk.  Only called by the
+ * ramdisk thread, once the zImage's size is known.
+ */
+static int zimage_commit(void) {
+	unsigned int early = zimage_early_len();
+	int ret, wr;
+
+	pthread_mutex_lock(&boot_lock);
+	while (!zimage_early_done)
+		pthread_cond_wait(&boot_cond, &boot_lock);
+	ret = zimage_early;
+	pthread_mutex_unlock(&boot_lock);
+	if (ret < 0)
+		return ret;
+
+	if (early < zimage_size) {
+		if ((wr = delta_write(bootfd, PGSZ + early, zimage + early,
+			zimage_size - early)) < 0) {
 			rprint("Writing zImage failed!");
-			ret = -errno;
-			goto ramdisk_close;
+			return wr;
 		}
+		ret += wr;
+	}
+	if (!ret)
+		rprint("zImage unchanged, skipping");
+	return 0;
+}
+
+/* Ramdisk streaming:
+ * The compressor's output is gathered into DELTA_BLOCK pieces and
+ * delta-written at its final, page-aligned offset.  That offset comes from
+ * the zImage's size, so the first flush may have to wait for it.  Pieces
+ * that overlap the old ramdisk or second stage are held in memory until the
+ * whole ramdisk has been produced; the rest go out as they come.  Only the
+ * ramdisk thread gets here.
+ */
+#define DELTA_BLOCK (256*1024)
+static char *rd_blk = NULL;
+static unsigned int rd_fill = 0, rd_pos = 0;
+static unsigned long rd_off = 0;
+struct rd_held {
+	struct rd_held *next;
+	unsigned long off;
+	unsigned int len;
+	char *buf;
+};
+static struct rd_held *rd_held = NULL, **rd_held_tail = &rd_held;
+
+static int ramdisk_place(void) {
+	int ret;
+
+	if (rd_pos)
+		return 0;
+	pthread_mutex_lock(&boot_lock);
+	while (zimage_ret > 0)
+		pthread_cond_wait(&boot_cond, &boot_lock);
+	ret = zimage_ret;
+	pthread_mutex_unlock(&boot_lock);
+	if (ret)
+		return ret;
+
+	rd_pos = zimage_size + PGSZ;
+	if (rd_pos & (PGSZ - 1)) rd_pos = (rd_pos & ~(PGSZ - 1)) + PGSZ;
+	return 0;
+}
+static int ramdisk_flush(void) {
+	struct rd_held *h;
+	int ret;
+
+	if (ret = ramdisk_place())
+		return ret;
+	if (zimage_size + rd_off + rd_fill + PGSZ * 3 > szlim) {
+		rprint("Ramdisk is too big!");
+		return -ENOSPC;
 	}
+	if (old_image_overlaps(rd_pos + rd_off, rd_fill)) {
+		if (!(h = malloc(sizeof(*h))))
+			return -ENOMEM;
+		h->next = NULL;
+		h->off = rd_pos + rd_off;
+		h->len = rd_fill;
+		h->buf = rd_blk;
+		*rd_held_tail = h;
+		rd_held_tail = &h->next;
+		rd_blk = NULL;
+	} else if ((ret = delta_write(bootfd, rd_pos + rd_off, rd_blk,
+		rd_fill)) < 0) {
+		return ret;
+	}
+	rd_off += rd_fill;
+	rd_fill = 0;
+	return 0;
+}
+
+/* Write out (or just drop) the held pieces */
+static int ramdisk_commit(int write) {
+	struct rd_held *h;
+	int ret = 0;
+#ifndef RECOVERY_BUILD
+	unsigned long held = 0;
+
+	for (h = rd_held; h; h = h->next)
+		held += h->len;
+	if (held)
+		printf("%s: %lu of %lu KB held over the old ramdisk\n",
+			__func__, held >> 10, rd_off >> 10);
 #endif
-	pos = zimage_size + PGSZ;
-	if (pos & (PGSZ - 1)) pos = (pos & ~(PGSZ - 1)) + PGSZ;
-	if (lseek(bootfd, pos, SEEK_SET) == -1) {
-		rprint("Ramdisk seek failed!");
-		ret = -errno;
-		goto ramdisk_close;
+	while (h = rd_held) {
+		if (write && !ret &&
+			(ret = delta_write(bootfd, h->off, h->buf, h->len)) > 0)
+			ret = 0;
+		rd_held = h->next;
+		free(h->buf);
+		free(h);
+	}
+	rd_held_tail = &rd_held;
+	return ret;
+}
+
+/* ramdisk_budget:
+ * How much room the new ramdisk has.  Until the new zImage's size is known,
+ * the old one stands in for it, so this never blocks.
+ */
+long ramdisk_budget(void) {
+	unsigned long used;
+	long ret;
+
+	pthread_mutex_lock(&boot_lock);
+	if (bootfd < 0) {
+		ret = -EBADF;
+	} else if (zimage_ret < 0) {
+		ret = zimage_ret;
+	} else {
+		used = (zimage_ret ? old_hdr.kernel_size : zimage_size) +
+			PGSZ * 3;
+		ret = szlim > used ? szlim - used : 0;
+	}
+	pthread_mutex_unlock(&boot_lock);
+	return ret;
+}
+
+int stream_ramdisk(const char *buf, unsigned long len) {
+	unsigned long cnt;
+	int ret;
+
+	while (len) {
+		if (!rd_blk && !(rd_blk = malloc(DELTA_BLOCK)))
+			return -ENOMEM;
+		cnt = DELTA_BLOCK - rd_fill;
+		if (cnt > len)
+			cnt = len;
+		memcpy(rd_blk + rd_fill, buf, cnt);
+		rd_fill += cnt;
+		buf += cnt;
+		len -= cnt;
+		if (rd_fill == DELTA_BLOCK && (ret = ramdisk_flush()))
+			return ret;
+	}
+	return 0;
+}
+
+/* add_ramdisk:
+ * With a NULL buf, the ramdisk was streamed and only the tail and the held
+ * pieces are left to write.  Otherwise, buf is written in one go; an
+ * untouched copy of the old ramdisk at its old offset needn't be written at
+ * all.  Either way, the rest of the zImage goes first.
+ */
+int add_ramdisk(void *buf, unsigned int size) {
+	int ret;
+
+	if (ramdisk || ramdisk_size) return -EBUSY;
+	if (buf && rd_off) return -EBUSY;
+
+	if (!buf) {
+		if (rd_fill && (ret = ramdisk_flush()))
+			goto out;
+		if (rd_off != size) {
+			ret = -EFAULT;
+			goto out;
+		}
+		if (!(ret = zimage_commit()))
+			ret = ramdisk_commit(1);
+		if (!ret)
+			ramdisk_size = size;
+		goto out;
+	}
+
+	rd_fill = 0;
+	if (ret = ramdisk_place())
+		goto out;
+	ramdisk = buf;
+	ramdisk_size = size;
+	if (zimage_size + ramdisk_size + PGSZ * 3 > szlim) {
+		rprint("Ramdisk is too big!");
+		ret = -ENOSPC;
+		goto out;
+	}
+	if (ret = zimage_commit())
+		goto out;
+	if (buf == old_ramdisk && old_ramdisk_pos() == rd_pos) {
+		rprint("Ramdisk unchanged, skipping");
+		ret = 0;
+	} else if ((ret = delta_write(bootfd, rd_pos, buf, size)) > 0) {
+		ret = 0;
 	}
+
+out:
+	ramdisk_commit(0);
+	free(rd_blk);
+	rd_blk = NULL;
+	if (ret < 0)
+		rprint("Writing ramdisk failed!");
+	return ret;
+}
+
+/* Delta writer:
+ * Read what's on the partition in DELTA_BLOCK chunks, compare it with the new
+ * data a page at a time, and write back only the pages that differ, merged
+ * into contiguous runs.  Reading is much cheaper than writing, and doesn't
+ * wear out the eMMC.  Anything that can't be read back counts as different.
+ * Returns the number of pages written, or -errno.  The counters cover the
+ * whole boot.img.
+ */
+static struct {
+	unsigned int compared, written, writes;
+	uint64_t ns;
+} delta;
+
+static int delta_flush(int fd, const char *buf, off_t off, unsigned int len) {
 #ifdef WRITE_BOOTIMG
-	for (pos = 0; pos < ramdisk_size; pos += wr) {
-		wr = write(bootfd, ramdisk + pos, ramdisk_size - pos);
-		if (wr < 0) {
-			rprint("Writing ramdisk failed!");
-			ret = -errno;
-			goto ramdisk_close;
+	int wr;
+#endif
+
+	__atomic_add_fetch(&delta.writes, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&delta.written, (len + PGSZ - 1) / PGSZ,
+		__ATOMIC_RELAXED);
+#ifdef WRITE_BOOTIMG
+	for (; len; len -= wr, buf += wr, off += wr) {
+		wr = pwrite(fd, buf, len, off);
+		if (wr < 0)
+			return -errno;
+	}
+#endif
+	return 0;
+}
+static int delta_write(int fd, off_t off, const char *buf, unsigned int len) {
+	struct timespec t0, t1;
+	unsigned int blk, pos, pg, n, run = 0, run_len = 0, written = 0;
+	char *tmp;
+	int rd, ret = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	if (!(tmp = malloc(DELTA_BLOCK)))
+		return -ENOMEM;
+
+	for (blk = 0; blk < len; blk += DELTA_BLOCK) {
+		n = len - blk < DELTA_BLOCK ? len - blk : DELTA_BLOCK;
+		if ((rd = pread(fd, tmp, n, off + blk)) < 0)
+			rd = 0;
+		for (pos = 0; pos < n; pos += PGSZ) {
+			pg = n - pos < PGSZ ? n - pos : PGSZ;
+			if (pos + pg > rd ||
+				memcmp(tmp + pos, buf + blk + pos, pg)) {
+				if (!run_len)
+					run = blk + pos;
+				run_len += pg;
+				continue;
+			}
+			/* Unchanged page ends the run */
+			if (run_len && (ret = delta_flush(fd, buf + run,
+				off + run, run_len)))
+				goto out;
+			written += (run_len + PGSZ - 1) / PGSZ;
+			run_len = 0;
 		}
 	}
+	if (run_len && !(ret = delta_flush(fd, buf + run, off + run, run_len)))
+		written += (run_len + PGSZ - 1) / PGSZ;
+
+out:
+	free(tmp);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	__atomic_add_fetch(&delta.compared, (len + PGSZ - 1) / PGSZ,
+		__ATOMIC_RELAXED);
+	__atomic_add_fetch(&delta.ns, (t1.tv_sec - t0.tv_sec) * 1000000000ULL +
+		t1.tv_nsec - t0.tv_nsec, __ATOMIC_RELAXED);
+	return ret ? ret : written;
+}
+
+/* generate_bootimg:
+ * By now the zImage and ramdisk are on the partition; the header is written
+ * last, so the old one stays valid until everything it points at is in place.
+ */
+int generate_bootimg(void) {
+	int ret, rd_ret;
+	int hdr_same;
+
+	/* Both threads write to bootfd, so wait for both before closing it */
+	ret = wait_thread(THREAD_ZIMAGE);
+	rd_ret = wait_thread(THREAD_RAMDISK);
+	if (ret || (ret = rd_ret)) goto out;
+
+#ifndef RECOVERY_BUILD
+	printf("%s: %i @ %d, %i @ %d\n", __func__,
+		zimage_size, PGSZ, ramdisk_size, rd_pos);
 #endif
 
-	/* Our header is fully populated, write it */
+	/* Our header is fully populated */
 	boot_hdr.kernel_addr = KBASE + 0x8000;
 	boot_hdr.kernel_size = zimage_size;
 	boot_hdr.ramdisk_addr = KBASE + RDOFF;
 	boot_hdr.ramdisk_size = ramdisk_size;
 	boot_hdr.tags_addr = KBASE + 0x100;
 	boot_hdr.page_size = PGSZ;
-	if (lseek(bootfd, 0, SEEK_SET)) return -errno;
-#ifdef WRITE_BOOTIMG
-	for (pos = 0; pos < sizeof(boot_hdr); pos += wr) {
-		wr = write(bootfd, ((char *)&boot_hdr) + pos,
-			sizeof(boot_hdr) - pos);
-		if (wr < 0) {
-			rprint("Writing header failed!");
-			ret = -errno;
-			break;
-		}
+
+	hdr_same = old_hdr_off == 0 &&
+		!memcmp(&old_hdr, &boot_hdr, sizeof(boot_hdr));
+	if (hdr_same) {
+		if (!delta.written)
+			rprint("boot.img is already up to date");
+	} else if ((ret = delta_write(bootfd, 0, (char *)&boot_hdr,
+		sizeof(boot_hdr))) < 0) {
+		rprint("Writing header failed!");
+		goto out;
+	} else {
+		rprint("Wrote boot.img");
+		ret = 0;
 	}
+
+#ifndef RECOVERY_BUILD
+	printf("%s: %u pages compared, %u written in %u writes, %llu us\n",
+		__func__, delta.compared, delta.written, delta.writes,
+		(unsigned long long)delta.ns / 1000);
 #endif
-ramdisk_close:
-	close(bootfd);
+
+out:
+	if (bootfd >= 0)
+		close(bootfd);
 	return ret;
 }
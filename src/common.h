@@ -24,11 +24,17 @@
 /* Inside the zip */
 #define ZIMAGE	"dkp-zImage"
 #define ZIPPNG	"dkp-splash.png"
+/* If present, the ramdisk is repacked with LZ4 (the kernel needs RD_LZ4) */
+#define ZIPLZ4	"dkp-lz4"
 //#define ZIPFMT	"dkp-splashX.png"
 
 #define SKIPSPLASH "/data/media/0/dkp/skipsplash"
 #define USERRLE "/data/media/0/dkp/splash.rle"
 #define USERPNG "/data/media/0/dkp/splash.png"
+/* The last converted PNG, so it needn't be converted again */
+#define SPLASHCACHE "/data/media/0/dkp/.splash.cache"
+/* Relative, like the system/ names in the zip */
+#define SYSMANIFEST "system/.dkp-manifest"
 
 /* Path to zip, provided by recovery */
 extern char *zip_path;
@@ -53,28 +59,77 @@ enum thread_slot {
 	THREAD_COUNT,
 };
 int wait_thread(enum thread_slot slot);
+int thread_done(enum thread_slot slot);
 void mod_prio(pthread_t thread, int new_pol);
 #ifndef RECOVERY_BUILD
 extern char *bootimg_path;
 #endif
 
-/* bootimg.c */
+/* bootimg.c
+ * get_ramdisk's buffer stays owned by bootimg.c, which compares against it
+ * before writing.  add_zimage hands over the zImage (NULL reports a failed
+ * unpack).  The new ramdisk is passed to stream_ramdisk as it's compressed,
+ * then add_ramdisk(NULL, size) finishes it; add_ramdisk with a buffer takes
+ * that instead.  The old kernel is written over once get_ramdisk has run,
+ * but the old ramdisk and second stage are left alone until add_ramdisk
+ * succeeds.  ramdisk_budget is the room left for the ramdisk.
+ * generate_bootimg only writes the header.
+ */
 int generate_bootimg(void);
 int get_ramdisk(char **rdbuf);
 int add_ramdisk(void *buf, unsigned int size);
 int add_zimage(void *buf, unsigned int size);
+int stream_ramdisk(const char *buf, unsigned long len);
+long ramdisk_budget(void);
 
 /* splash.c */
 void *generate_splash(void *arg);
 
-/* ramdisk.c */
+/* ramdisk.c
+ * An override is either one malloc'd buffer, or a chain of malloc'd
+ * file_chunks, each with its data right behind it.
+ */
+struct file_chunk;
 int ramdisk_push_override(char *name, char *buf, unsigned int size);
+int ramdisk_push_override_chunks(char *name, struct file_chunk *chunks);
 void *generate_ramdisk(void *arg);
 
-/* system.c */
+/* system.c
+ * system_throttle(1) holds back most extraction workers until
+ * system_throttle(0).
+ */
 void *unpack_system(void *arg);
+void system_throttle(int busy);
 
 /* zimage.c */
 void *unpack_zimage(void *arg);
 
+/* zip.c
+ * main indexes the install zip once, before starting any threads; the index
+ * is read-only after that and shared by everyone.  Whole members can be
+ * mapped in place or copied file-to-file (stored only), or extracted into a
+ * caller's buffer; anything else gets its own zip_file cursor.  zip_fread
+ * returns the bytes read, 0 at the end, or -errno; zip_fclose returns
+ * -EBADMSG if a fully read member fails its CRC.
+ */
+struct zip_entry {
+	const char *name; /* NUL-terminated */
+	unsigned int namelen, method;
+	unsigned long crc, csize, usize;
+	unsigned long attr; /* external attributes */
+	unsigned int mode; /* st_mode, if made on Unix; else 0 */
+	unsigned long off; /* of the local header */
+};
+struct zip_file;
+int zip_index_open(const char *path);
+const struct zip_entry *zip_find(const char *name);
+unsigned int zip_count(void);
+const struct zip_entry *zip_entry_at(unsigned int i);
+int zip_map(const struct zip_entry *ze, const char **data);
+int zip_extract(const struct zip_entry *ze, char *dst);
+int zip_copy(const struct zip_entry *ze, const char *src, int fd);
+struct zip_file *zip_fopen(const struct zip_entry *ze);
+long zip_fread(struct zip_file *f, char *buf, unsigned long len);
+int zip_fclose(struct zip_file *f);
+
 #endif
@@ -1,15 +1,16 @@
 #include <unistd.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <errno.h>
 #include <pthread.h>
+#include <sched.h>
 #include <sys/types.h>
 #include <sys/uio.h>
 
 #include "common.h"
 #include "cpio.h"
 #include <zlib/zlib.h>
-#include <zlib/contrib/minizip/unzip.h>
 
 #include <stdio.h>
 
@@ -47,100 +48,227 @@ void ltox(char *p, unsigned long v) {
 }
 
 static unsigned int global_ino = 721;
-void nudge_ino(struct cpio_hdr *hdr) {
-	if (xtol(hdr->ino))
-		ltox(hdr->ino, global_ino++);
+int nudge_ino(struct cpio_hdr *hdr) {
+	unsigned long ino = xtol(hdr->ino);
+
+	if (!ino)
+		return 0;
+	if (ino == global_ino) {
+		global_ino++;
+		return 0;
+	}
+	ltox(hdr->ino, global_ino++);
+	return 1;
+}
+
+/* arena bits:
+ * A simple bump allocator over a list of slabs.  Allocations are rounded up to
+ * keep everything aligned.  Oversized requests get a dedicated slab, linked
+ * behind the current one so its free space isn't wasted.
+ */
+struct arena_slab {
+	struct arena_slab *next;
+	unsigned long used, size;
+	char buf[];
+};
+#define ARENA_SLAB_DATA (ALLOC_CHUNK_SZ - sizeof(struct arena_slab))
+static struct arena_slab *arena = NULL;
+static pthread_mutex_t arena_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void *cpio_arena_alloc(unsigned long size) {
+	struct arena_slab *s;
+	void *p = NULL;
+
+	size = (size + 7) & ~7;
+	pthread_mutex_lock(&arena_lock);
+	if (arena && arena->size - arena->used >= size) {
+		s = arena;
+	} else if (size > ARENA_SLAB_DATA / 4) {
+		if (!(s = malloc(sizeof(struct arena_slab) + size)))
+			goto out;
+		s->used = 0;
+		s->size = size;
+		if (arena) {
+			s->next = arena->next;
+			arena->next = s;
+		} else {
+			s->next = NULL;
+			arena = s;
+		}
+	} else {
+		if (!(s = malloc(ALLOC_CHUNK_SZ)))
+			goto out;
+		s->used = 0;
+		s->size = ARENA_SLAB_DATA;
+		s->next = arena;
+		arena = s;
+	}
+	p = s->buf + s->used;
+	s->used += size;
+out:
+	pthread_mutex_unlock(&arena_lock);
+	return p;
+}
+void cpio_arena_free(void) {
+	struct arena_slab *s;
+
+	pthread_mutex_lock(&arena_lock);
+	while (s = arena) {
+		arena = s->next;
+		free(s);
+	}
+	pthread_mutex_unlock(&arena_lock);
 }
 
 /* file chunk bits:
- * The magic __alloc field determines whether to free() each chunk
- * (facilitating e.g. packed allocations).  Otherwise, this is just a simple
- * linked list of buffers.
+ * Chunks live in the arena, with their data packed directly behind them.
+ * Otherwise, this is just a simple linked list of buffers.
  *
  * The compression thread knows to pad the first and last chunks.
  */
-struct file_chunk *file_chunk_alloc(struct file_chunk *c) {
+struct file_chunk *file_chunk_alloc(struct file_chunk *c, unsigned long size) {
 	struct file_chunk *n;
 
-	n = malloc(ALLOC_CHUNK_SZ);
+	n = cpio_arena_alloc(sizeof(struct file_chunk) + CHUNK_DATA_SZ(size));
+	if (!n)
+		return NULL;
 	n->len = 0;
-	n->__alloc = 1;
-	n->buf = ((char *)n) + sizeof(struct file_chunk);
+	n->buf = (char *)&n[1];
 	n->next = NULL;
 
 	c->next = n;
 	return n;
 }
-void file_chunk_free(struct file_chunk *c) {
-	if (c) {
-		file_chunk_free(c->next);
-		if (c->__alloc)
-			free(c);
-	}
-}
 
 /* cpio file entries:
- * These are a complete cpio header, with some file_chunk magic to dramatically
- * simplify the compression routines.
+ * These are a cpio header, with some file_chunk magic to dramatically simplify
+ * the compression routines.  New entries get the header (and only as much of
+ * the name as needed) packed behind them.  Views just point at an existing
+ * header.
  */
-struct cpio_ent *cpio_ent_alloc(void) {
-	struct cpio_ent *e = malloc(ALLOC_CHUNK_SZ);
+struct cpio_ent *cpio_ent_alloc(unsigned long namesize) {
+	struct cpio_ent *e = cpio_arena_alloc(
+		sizeof(struct cpio_ent) + CPIO_HDR_LEN + namesize + 3);
 
 	if (e) {
 		e->__poison = 0;
+		e->__shared = 0;
+		e->__dirty = 1;
+		e->hdr = (struct cpio_hdr *)&e[1];
 		e->data.len = 0;
-		e->data.buf = (char *)&e->hdr;
+		e->data.buf = (char *)e->hdr;
 		e->data.next = NULL;
-		e->data.__alloc = 0;
 	}
 
 	return e;
 }
-void cpio_ent_free(struct cpio_ent *e) {
-	file_chunk_free(&e->data);
-	free(e);
+struct cpio_ent *cpio_ent_view(struct cpio_hdr *hdr, unsigned long namesize) {
+	struct cpio_ent *e = cpio_arena_alloc(sizeof(struct cpio_ent));
+
+	if (e) {
+		e->__poison = 0;
+		e->__shared = 0;
+		e->__dirty = 0;
+		e->hdr = hdr;
+		e->data.len = CPIO_HDR_LEN + namesize;
+		e->data.buf = (char *)hdr;
+		e->data.next = NULL;
+	}
+
+	return e;
+}
+/* Swap a view's body for a private, NUL-terminated copy, so overrides can
+ * patch it and use str*() on it.  Returns the (new) body chunk, or NULL if
+ * there's no body or no memory.  The caller decides whether it's dirty.
+ */
+struct file_chunk *cpio_ent_unshare(struct cpio_ent *e) {
+	struct file_chunk *c = e->data.next, *n;
+
+	if (!c || !e->__shared)
+		return c;
+	if (!(n = file_chunk_alloc(&e->data, c->len))) {
+		e->data.next = c;
+		return NULL;
+	}
+	memcpy(n->buf, c->buf, c->len);
+	n->buf[c->len] = '\0';
+	n->len = c->len;
+	n->next = c->next;
+	e->__shared = 0;
+	return n;
 }
 
 /* file list bits:
- * Simple synchronized linked list implementation.  No frills.
+ * Single-producer, single-consumer ring.  Only one side can need to sleep at a
+ * time (the ring can't be both full and empty), but a freshly-woken sleeper
+ * may not have left cond_wait yet, so waiting is a count.  The waker publishes
+ * its index before checking the count; the sleeper bumps the count before
+ * rechecking the index.  The seq_cst ordering guarantees at least one of them
+ * notices the other.
  */
+#define FILE_LIST_SPIN (64)
+
 int file_list_init(struct cpio_file_list *l) {
 	int ret;
+	l->head = l->pushed = l->push_sleeps = 0;
+	l->tail = l->pop_sleeps = 0;
+	l->waiting = 0;
 	if (ret = pthread_mutex_init(&l->lock, NULL))
 		return ret;
 	if (ret = pthread_cond_init(&l->cond, NULL))
 		return ret;
 	return 0;
 }
-void file_list_push(struct cpio_file_list *l, struct cpio_ent *e) {
-	e->next = NULL;
+/* Wait for the other side to move *idx away from val */
+static void file_list_wait(struct cpio_file_list *l, unsigned int *idx,
+		unsigned int val, unsigned int *sleeps) {
+	int spin;
+
+	for (spin = 0; spin < FILE_LIST_SPIN; spin++) {
+		if (__atomic_load_n(idx, __ATOMIC_ACQUIRE) != val)
+			return;
+		sched_yield();
+	}
 
+	(*sleeps)++;
 	pthread_mutex_lock(&l->lock);
-	if (l->head)
-		l->head->next = e;
-	l->head = e;
-	if (!l->tail) {
-		l->tail = e;
-		pthread_cond_signal(&l->cond);
-	}
+	__atomic_add_fetch(&l->waiting, 1, __ATOMIC_SEQ_CST);
+	while (__atomic_load_n(idx, __ATOMIC_SEQ_CST) == val)
+		pthread_cond_wait(&l->cond, &l->lock);
+	__atomic_sub_fetch(&l->waiting, 1, __ATOMIC_RELAXED);
 	pthread_mutex_unlock(&l->lock);
 }
+static void file_list_wake(struct cpio_file_list *l) {
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&l->waiting, __ATOMIC_RELAXED)) {
+		pthread_mutex_lock(&l->lock);
+		pthread_cond_broadcast(&l->cond);
+		pthread_mutex_unlock(&l->lock);
+	}
+}
+void file_list_push(struct cpio_file_list *l, struct cpio_ent *e) {
+	unsigned int head = l->head;
+
+	if (head - __atomic_load_n(&l->tail, __ATOMIC_ACQUIRE) ==
+			FILE_LIST_LEN)
+		file_list_wait(l, &l->tail, head - FILE_LIST_LEN,
+			&l->push_sleeps);
+
+	l->ring[head & (FILE_LIST_LEN - 1)] = e;
+	__atomic_store_n(&l->head, head + 1, __ATOMIC_RELEASE);
+	l->pushed++;
+	file_list_wake(l);
+}
 struct cpio_ent *file_list_pop(struct cpio_file_list *l) {
 	struct cpio_ent *e;
+	unsigned int tail = l->tail;
 
-	pthread_mutex_lock(&l->lock);
-	if (!l->tail)
-		pthread_cond_wait(&l->cond, &l->lock);
-	e = (struct cpio_ent *)l->tail;
-	if (e) {
-		l->tail = e->next;
-		if (!l->tail)
-			l->head = NULL;
-	} else {
-		l->tail = NULL;
-		l->head = NULL;
-	}
-	pthread_mutex_unlock(&l->lock);
+	if (__atomic_load_n(&l->head, __ATOMIC_ACQUIRE) == tail)
+		file_list_wait(l, &l->head, tail, &l->pop_sleeps);
+
+	e = l->ring[tail & (FILE_LIST_LEN - 1)];
+	__atomic_store_n(&l->tail, tail + 1, __ATOMIC_RELEASE);
+	file_list_wake(l);
 
 	if (!e)
 		rprint("File list exploded?!");
@@ -149,106 +277,165 @@ struct cpio_ent *file_list_pop(struct cpio_file_list *l) {
 
 /* If we blow up, unstick the other threads with a TRAILER!!!. */
 static void decompress_cleanup(void *arg) {
-	struct cpio_ent *e = cpio_ent_alloc();
+	struct cpio_ent *e = cpio_ent_alloc(sizeof("TRAILER!!!"));
 	rprint("Aborting decompression");
 	if (!e) {
 		rprint("Out of memory, blowing up!");
 		abort();
 	}
-	strcpy(e->hdr.name, "TRAILER!!!");
+	strcpy(e->hdr->name, "TRAILER!!!");
 	e->data.len = CPIO_HDR_LEN + 10;
 	file_list_push(&read_files, e);
 }
-/* decompress (with optional 4-byte pad) data into a file_chunk, allocating
- * more chunks as needed
+/* Ramdisk input: the whole archive, decoded up front.  Neither format gains
+ * anything from streaming, since the compressed ramdisk is already in memory.
+ * The parsed cpio_ents point into buf, so it lives until compression is done.
  */
-static int decompress(z_stream *strm, struct file_chunk *data,
-		unsigned long len, int pad) {
-	if (!len)
-		return 0;
-	if (!data || !data->buf)
-		return -EINVAL;
-	while (len) {
-		strm->next_out = (uint8_t *)data->buf + data->len;
-		if (len < CHUNK_DATA_SZ - data->len)
-			strm->avail_out = len;
-		else
-			strm->avail_out = CHUNK_DATA_SZ - data->len;
-		data->len += strm->avail_out;
-		len -= strm->avail_out;
-		/* We overcommit chunks to simplify this */
-		if (!len && pad && (data->len & 3))
-			strm->avail_out += 4 - (data->len & 3);
-
-		while (strm->avail_out) {
-			int ret = inflate(strm, Z_SYNC_FLUSH);
-			if (ret != Z_OK && ret != Z_STREAM_END)
-				return -EFAULT;
-			if ((ret == Z_STREAM_END || !strm->avail_in) &&
-					strm->avail_out) {
-				rprint("Premature end of stream!");
-				return -EFAULT;
-			}
+struct rd_input {
+	char *buf;
+	unsigned long pos, len;
+};
+
+/* gunzip_ramdisk:
+ * Inflate a whole gzip ramdisk into a freshly allocated buffer, in a single
+ * inflate() call where possible.  The buffer is sized from the ISIZE trailer,
+ * and doubled if that turns out to be wrong (e.g. padding after the stream).
+ * Returns the decoded size, or -errno.
+ */
+static long gunzip_ramdisk(const char *src, unsigned long len, char **out) {
+	const uint8_t *t = (const uint8_t *)src + len - 4;
+	z_stream strm;
+	unsigned long size = 0;
+	char *buf = NULL, *n;
+	long ret;
+	int zret;
+
+	if (len >= 18)
+		size = t[0] | (t[1] << 8) | (t[2] << 16) | ((uint32_t)t[3] << 24);
+	/* deflate can't do better than 1032:1 */
+	if (size < len || size / 1032 > len)
+		size = len * 4;
+
+	strm.zalloc = Z_NULL;
+	strm.zfree = Z_NULL;
+	strm.opaque = Z_NULL;
+	strm.avail_in = len;
+	strm.next_in = (uint8_t *)src;
+	if (inflateInit2(&strm, 31) != Z_OK)
+		return -ENOMEM;
+
+	/* One byte of slack, so a correct guess still reaches Z_STREAM_END */
+	for (;;) {
+		if (!(n = realloc(buf, size + 1))) {
+			ret = -ENOMEM;
+			goto out;
 		}
-
-		if (len) {
-			data = file_chunk_alloc(data);
-			if (!data)
-				return -ENOMEM;
+		buf = n;
+		strm.next_out = (uint8_t *)buf + strm.total_out;
+		strm.avail_out = size + 1 - strm.total_out;
+		zret = inflate(&strm, Z_FINISH);
+		if (zret == Z_STREAM_END)
+			break;
+		if (zret != Z_BUF_ERROR || strm.avail_out) {
+			ret = -EFAULT;
+			goto out;
 		}
+		size *= 2;
 	}
-	return 0;
+
+	ret = strm.total_out;
+	*out = buf;
+	buf = NULL;
+out:
+	inflateEnd(&strm);
+	free(buf);
+	return ret;
+}
+
+/* rd_take:
+ * Consume len bytes, plus padding to a multiple of 4, from the archive.
+ * Returns a pointer to them, or NULL at a premature end of stream.
+ */
+static char *rd_take(struct rd_input *in, unsigned long len) {
+	char *p = in->buf + in->pos;
+
+	if (in->len - in->pos < len + (-len & 3)) {
+		rprint("Premature end of stream!");
+		return NULL;
+	}
+	in->pos += len + (-len & 3);
+	return p;
 }
 
 /* decompression:
- * Build a cpio_ent for each file, the push it to override_thread.
+ * Parse a cpio_ent for each file out of the decoded archive, then push it to
+ * override_thread.  Entries are views into the archive; nothing is copied
+ * unless an override changes it.
  */
 struct cpio_file_list read_files;
 static void *decompress_thread(void *arg) {
-	z_stream *strm = (z_stream *)arg;
+	struct rd_input *in = (struct rd_input *)arg;
 	struct cpio_ent *e;
+	struct cpio_hdr *hdr;
+	struct file_chunk *c;
+	unsigned long namesize, size;
 	long ret = 0;
 	int more = 1;
 
 	pthread_cleanup_push(decompress_cleanup, NULL);
 
 	do {
-		e = cpio_ent_alloc();
-		if (!e) {
-			ret = -ENOMEM;
+		/* Sanity-check header */
+		hdr = (struct cpio_hdr *)(in->buf + in->pos);
+		if (in->len - in->pos < CPIO_HDR_LEN) {
+			rprint("Premature end of stream!");
+			ret = -EFAULT;
 			goto out_fail;
 		}
-
-		/* Decompress and sanity-check header */
-		if (ret = decompress(strm, &e->data, CPIO_HDR_LEN, 0))
-			goto out_fail;
-		if (strncmp(e->hdr.magic, CPIO_MAGIC, strlen(CPIO_MAGIC))) {
+		if (strncmp(hdr->magic, CPIO_MAGIC, strlen(CPIO_MAGIC))) {
 			rprint("Header mismatch!");
 			ret = -EINVAL;
 			goto out_fail;
 		}
-		if (!xtol(e->hdr.namesize)) {
+		namesize = xtol(hdr->namesize);
+		if (!namesize || namesize > CPIO_NAME_MAX) {
+			rprint("Bogus filename!");
+			ret = -EINVAL;
+			goto out_fail;
+		}
+		if (!rd_take(in, CPIO_HDR_LEN + namesize)) {
+			ret = -EFAULT;
+			goto out_fail;
+		}
+		if (hdr->name[namesize - 1]) {
 			rprint("Bogus filename!");
 			ret = -EINVAL;
 			goto out_fail;
 		}
 
-		/* Decompress filename */
-		if (ret = decompress(strm, &e->data, xtol(e->hdr.namesize), 1))
+		e = cpio_ent_view(hdr, namesize);
+		if (!e) {
+			ret = -ENOMEM;
 			goto out_fail;
+		}
 
-		/* Maybe decompress body */
-		if (!strncmp(e->hdr.name, "TRAILER!!!", 10)) {
+		/* Maybe attach body */
+		if (!strncmp(hdr->name, "TRAILER!!!", 10)) {
 			more = 0;
-		} else if (xtol(e->hdr.size)) {
-			if (ret = decompress(strm,
-				file_chunk_alloc(&e->data),
-				xtol(e->hdr.size), 1))
+		} else if (size = xtol(hdr->size)) {
+			if (!(c = file_chunk_alloc(&e->data, 0))) {
+				ret = -ENOMEM;
+				goto out_fail;
+			}
+			if (!(c->buf = rd_take(in, size))) {
+				ret = -EFAULT;
 				goto out_fail;
+			}
+			c->len = size;
+			e->__shared = 1;
 		}
 		file_list_push(&read_files, e);
 	} while (more);
-	inflateEnd(strm);
 
 	pthread_cleanup_pop(0);
 
@@ -256,14 +443,226 @@ out_fail:
 	return (void *)ret;
 }
 
+/* Ramdisk output: the parallel gzip compressor, the whole-buffer one, or LZ4
+ * legacy frames.
+ *
+ * src is the decoded archive, if the old compressed ramdisk could stand in for
+ * the new one (i.e. it's in the output format).  While entries arrive
+ * untouched and in their original order, compress_thread just tracks how much
+ * of src they cover.  The first changed entry flushes that prefix to the
+ * compressor; if none change, nothing is compressed at all.
+ */
+struct rd_output {
+	struct pdeflate *pd;
+	struct bdeflate *bd;
+	struct lz4w *lz;
+	const char *src;
+	int level; /* gzip level from the size budget */
+	int cls; /* class of the entry being compressed */
+	unsigned long total; /* expected archive size */
+	unsigned long old; /* old gzip'd size, if it was gzip'd */
+};
+static int rd_write(struct rd_output *out, const char *buf,
+		unsigned long len) {
+	if (out->lz)
+		return lz4w_write(out->lz, buf, len);
+	if (out->bd)
+		return bdeflate_write(out->bd, buf, len);
+	return pdeflate_write(out->pd, buf, len);
+}
+static long rd_finish(struct rd_output *out) {
+	if (out->lz)
+		return lz4w_finish(out->lz);
+	if (out->bd)
+		return bdeflate_finish(out->bd);
+	return pdeflate_finish(out->pd);
+}
+
+/* Per-entry compression parameters
+ * Ramdisk contents fall into a few classes with very different statistics.
+ * rd_classify picks one from the name, the magic and a sample of the body,
+ * and the parallel gzip compressor switches level and strategy to suit.  A
+ * switch can cost a deflate block, so small and empty entries just carry on
+ * with whatever came before (RD_KEEP).  Levels are minimums: the size budget
+ * may call for more, and Z_DEFAULT_COMPRESSION takes whatever it says.
+ * Packed data is always stored.
+ */
+enum rd_class {
+	RD_KEEP = -1,
+	RD_DEFAULT,
+	RD_TEXT, /* rc files, scripts, props */
+	RD_ELF,
+	RD_RLE, /* the splash screen */
+	RD_PACKED, /* already compressed */
+};
+static const struct {
+	int level, strategy;
+} rd_class_params[] = {
+	[RD_DEFAULT] = { Z_DEFAULT_COMPRESSION, Z_DEFAULT_STRATEGY },
+	[RD_TEXT] = { 7, Z_DEFAULT_STRATEGY },
+	[RD_ELF] = { Z_DEFAULT_COMPRESSION, Z_DEFAULT_STRATEGY },
+	[RD_RLE] = { 4, Z_DEFAULT_STRATEGY },
+	[RD_PACKED] = { 0, Z_DEFAULT_STRATEGY },
+};
+#define RD_CLASS_MIN (4096) /* smaller entries are RD_KEEP */
+#define RD_SAMPLE (4096)
+
+static enum rd_class rd_classify(struct cpio_ent *e) {
+	static const unsigned char packed[][4] = {
+		{ 0x1f, 0x8b }, /* gzip */
+		{ 'P', 'K', 3, 4 }, /* zip, apk, jar */
+		{ 0x89, 'P', 'N', 'G' },
+		{ 0xfd, '7', 'z', 'X' }, /* xz */
+		{ 'B', 'Z', 'h' },
+		{ 0x02, 0x21, 0x4c, 0x18 }, /* lz4 legacy */
+		{ 0x04, 0x22, 0x4d, 0x18 }, /* lz4 */
+	};
+	unsigned int hist[256] = { 0 };
+	unsigned long n, sq = 0, text = 0;
+	const unsigned char *p;
+	const char *name;
+	struct file_chunk *c = e->data.next;
+	int i;
+
+	if (!c || xtol(e->hdr->size) < RD_CLASS_MIN)
+		return RD_KEEP;
+
+	name = strrchr(e->hdr->name, '/');
+	name = name ? name + 1 : e->hdr->name;
+	n = strlen(name);
+	if (n > 4 && !strcmp(name + n - 4, ".rle"))
+		return RD_RLE;
+	if (c->len < 4)
+		return RD_DEFAULT;
+
+	p = (const unsigned char *)c->buf;
+	if (!memcmp(p, "\177ELF", 4))
+		return RD_ELF;
+	for (i = 0; i < sizeof(packed) / sizeof(packed[0]); i++)
+		if (!memcmp(p, packed[i], packed[i][3] ? 4 : packed[i][2] ? 3 : 2))
+			return RD_PACKED;
+
+	/* Sample the middle: mostly printable is text; a byte histogram
+	 * about as flat as random data (chi-squared under 2x its expected
+	 * 255) is already compressed.
+	 */
+	n = c->len < RD_SAMPLE ? c->len : RD_SAMPLE;
+	p += (c->len - n) / 2;
+	for (i = 0; i < n; i++)
+		hist[p[i]]++;
+	for (i = 0; i < 256; i++) {
+		sq += hist[i] * hist[i];
+		if (i >= ' ' && i < 127 || i == '\t' || i == '\n' || i == '\r')
+			text += hist[i];
+	}
+	if (text * 20 >= n * 19)
+		return RD_TEXT;
+	if (sq * 256 / n - n < 512)
+		return RD_PACKED;
+	return RD_DEFAULT;
+}
+
+/* Only the parallel gzip compressor takes parameters */
+static void rd_params(struct rd_output *out, enum rd_class cls) {
+	int level;
+
+	if (!out->pd || cls == RD_KEEP)
+		return;
+	level = rd_class_params[cls].level;
+	if (cls != RD_PACKED && level < out->level)
+		level = out->level;
+	out->cls = cls;
+	pdeflate_params(out->pd, level, rd_class_params[cls].strategy);
+}
+
+/* Size budget
+ * The gzip level follows the room left on the boot partition.  We start at
+ * the fastest level the old ramdisk says will fit, then project the final
+ * size as output comes in: what we've written, plus whatever's left of the
+ * old ramdisk past the equivalent point.  Coming within RD_HEADROOM of the
+ * budget raises the level.  A projection is only a guess, so it never fails
+ * the install; only the real size check in ramdisk_flush does.
+ *
+ * Without a gzip'd old ramdisk, the rest is projected at the ratio so far.
+ * Ramdisks mix very different contents, so that's rougher still.
+ *
+ * rd_level_cost is the rough output size at each level relative to level 6,
+ * in thousandths, from zlib on typical ramdisk contents.  The old ramdisk is
+ * taken to be level 6.
+ */
+#define RD_LEVEL_MIN (1)
+#define RD_BUDGET_MIN (512*1024) /* input needed for a useful projection */
+#define RD_HEADROOM(budget) ((budget) / 32)
+static const unsigned short rd_level_cost[10] = {
+	0, 1120, 1090, 1070, 1030, 1008, 1000, 999, 997, 996
+};
+
+static int rd_start_level(long budget, unsigned long oldlen) {
+	int level;
+
+	if (budget < 0)
+		return 6;
+	for (level = RD_LEVEL_MIN; level < 9; level++)
+		if ((unsigned long long)oldlen * rd_level_cost[level] / 1000 <=
+			budget - RD_HEADROOM(budget))
+			break;
+	return level;
+}
+
+static void rd_budget(struct rd_output *out) {
+	unsigned long in, done;
+	unsigned long long proj, left;
+	long budget;
+	int level;
+
+	pdeflate_progress(out->pd, &in, &done);
+	if (in < RD_BUDGET_MIN || (budget = ramdisk_budget()) < 0)
+		return;
+
+	if (out->old) {
+		left = (unsigned long long)done * 1000 /
+			rd_level_cost[out->level];
+		left = out->old > left ? out->old - left : 0;
+	} else {
+		left = out->total > in ? out->total - in : 0;
+		left = left * done / in * 1000 / rd_level_cost[out->level];
+	}
+	for (level = out->level; ; level++) {
+		proj = done + left * rd_level_cost[level] / 1000;
+		if (proj <= budget - RD_HEADROOM(budget) || level == 9)
+			break;
+	}
+
+	if (level != out->level) {
+#ifndef RECOVERY_BUILD
+		printf("%s: %llu of %ld projected, level %d -> %d\n", __func__,
+			proj, budget, out->level, level);
+#endif
+		out->level = level;
+		rd_params(out, out->cls);
+	}
+}
+
+/* Catching up on the untouched prefix needs the class changes within it */
+struct rd_mark {
+	const char *at;
+	enum rd_class cls;
+	struct rd_mark *next;
+};
+
 /* compression:
- * Pull cpio_ents from override_thread and compress them.
+ * Pull cpio_ents from override_thread and hand them to the compressor.
+ * Returns the compressed size, 0 if the archive is unchanged, or -errno.
  */
 struct cpio_file_list write_files;
 static void *compress_thread(void *arg) {
-	z_stream *strm = (z_stream *)arg;
+	struct rd_output *out = (struct rd_output *)arg;
 	struct cpio_ent *e;
 	struct file_chunk *c;
+	const char *clean = out->src; /* end of the untouched prefix */
+	struct rd_mark *marks = NULL, **mark_tail = &marks, *m;
+	const char *from;
+	enum rd_class cls;
 	int more = 1;
 	long ret = 0;
 	int byte_cnt;
@@ -275,58 +674,88 @@ static void *compress_thread(void *arg) {
 			ret = -EFAULT;
 			goto out_fail;
 		}
-		if (e->__poison) {
-			cpio_ent_free(e);
+		if (e->__poison)
 			continue;
-		}
 
-		nudge_ino(&e->hdr);
-		byte_cnt = 0;
-
-		for (c = &e->data; c; c = c->next) {
-			strm->next_in = (uint8_t *)c->buf;
-			strm->avail_in = c->len;
-			byte_cnt += c->len;
-			/* Pad header and file data */
-			while (strm->avail_in) {
-				if (deflate(strm, Z_NO_FLUSH) != Z_OK) {
-					ret = -EFAULT;
+		if (nudge_ino(e->hdr))
+			e->__dirty = 1;
+		cls = out->pd ? rd_classify(e) : RD_KEEP;
+
+		if (clean && !e->__dirty && e->data.buf == clean) {
+			if (cls != RD_KEEP) {
+				if (!(m = cpio_arena_alloc(sizeof(*m)))) {
+					ret = -ENOMEM;
 					goto out_fail;
 				}
+				m->at = clean;
+				m->cls = cls;
+				m->next = NULL;
+				*mark_tail = m;
+				mark_tail = &m->next;
 			}
-			if ((c == &e->data || !c->next) && (byte_cnt & 3)) {
-				strm->avail_in = 4 - (byte_cnt & 3);
-				byte_cnt += strm->avail_in;
-				strm->next_in = (uint8_t *)&pad;
-				while (strm->avail_in) {
-					if (deflate(strm, Z_NO_FLUSH) != Z_OK) {
-						ret = -EFAULT;
+			clean += (e->data.len + 3) & ~3;
+			if (e->data.next)
+				clean += (e->data.next->len + 3) & ~3;
+		} else {
+			/* Catch up on the untouched prefix */
+			for (from = out->src, m = marks; clean; m = m->next) {
+				if (ret = rd_write(out, from,
+					(m ? m->at : clean) - from))
+					goto out_fail;
+				if (!m)
+					break;
+				rd_params(out, m->cls);
+				from = m->at;
+			}
+			clean = NULL;
+
+			rd_params(out, cls);
+
+			byte_cnt = 0;
+			for (c = &e->data; c; c = c->next) {
+				byte_cnt += c->len;
+				if (ret = rd_write(out, c->buf, c->len))
+					goto out_fail;
+				/* Pad header and file data */
+				if ((c == &e->data || !c->next) &&
+					(byte_cnt & 3)) {
+					if (ret = rd_write(out, (char *)&pad,
+						4 - (byte_cnt & 3)))
 						goto out_fail;
-					}
+					byte_cnt += 4 - (byte_cnt & 3);
 				}
 			}
+			if (out->pd)
+				rd_budget(out);
 		}
 
-		if (!strncmp(e->hdr.name, "TRAILER!!!", 10))
+		if (!strncmp(e->hdr->name, "TRAILER!!!", 10))
 			more = 0;
-
-		cpio_ent_free(e);
 	} while (more);
 
-	if (deflate(strm, Z_FINISH) != Z_STREAM_END) {
-		rprint("Error finishing compression!");
-		ret = -EFAULT;
-		goto out_fail;
+	/* Nothing changed, so don't bother finishing */
+	if (clean) {
+		rd_finish(out);
+		return (void *)0;
 	}
-	deflateEnd(strm);
+
+	/* Hand back the compressed size */
+	if ((ret = rd_finish(out)) < 0)
+		rprint("Error finishing compression!");
+	return (void *)ret;
 
 out_fail:
+	rd_finish(out);
+	/* Keep draining, so override_thread can't block on a full list */
+	while (more && (e = file_list_pop(&write_files)))
+		more = strncmp(e->hdr->name, "TRAILER!!!", 10);
 	return (void *)ret;
 }
 
 /* override_thread:
  * Pull cpio_ents from decompress_thread, check them against the ramdisk
- * overrides, and push them to compress_thread.
+ * overrides, and push them to compress_thread.  Entries still waiting on
+ * another thread are held back and go in just before the trailer.
  */
 static int override_thread(void) {
 	int ret;
@@ -338,13 +767,17 @@ static int override_thread(void) {
 		if (!e)
 			return -EFAULT;
 
-		if (ret = ramdisk_handle_overrides(e)) {
+		if ((ret = ramdisk_handle_overrides(e)) < 0) {
 			rprint("Patching file failed!");
 			return ret;
 		}
+		if (ret)
+			continue;
 
-		if (!strncmp(e->hdr.name, "TRAILER!!!", 10))
+		if (!strncmp(e->hdr->name, "TRAILER!!!", 10)) {
+			ramdisk_flush_deferred();
 			more = 0;
+		}
 
 		file_list_push(&write_files, e);
 	} while (more);
@@ -355,65 +788,78 @@ static int override_thread(void) {
 /* generate_ramdisk:
  * Set up the file queues, buffers, zlib streams and override miscellany.  Kick
  * off the decompress and compress threads, then start checking files for
- * overrides.
+ * overrides.  Compressed output goes straight to the boot partition through
+ * stream_ramdisk.
  */
-#define RAMDISK_SIZE (5*1024*1024)
 void *generate_ramdisk(void *arg) {
-	long ret = 0;
+	long ret = 0, oldlen;
 	void *thread_ret;
-	char *rdbuf, *oldrd;
+	char *oldrd;
 	pthread_t decomp_th, comp_th;
-	z_stream decomp, comp;
+	struct rd_input in;
+	struct rd_output out;
+	int oldlz;
 
 	/* Start decompression */
-	decomp.zalloc = Z_NULL;
-	decomp.zfree = Z_NULL;
-	decomp.opaque = Z_NULL;
-	decomp.avail_in = get_ramdisk(&oldrd);
-	decomp.next_in = (unsigned char *)oldrd;
-
-	if (decomp.avail_in < 0) {
+	ret = oldlen = get_ramdisk(&oldrd);
+	if (ret < 0) {
 		rprint("Error reading ramdisk!");
-		ret = decomp.avail_in;
 		goto out;
 	}
 
-	if (ret = inflateInit2(&decomp, 31)) {
-		rprint("Error starting decompression!");
+	if (oldlz = lz4_is_legacy(oldrd, ret))
+		ret = lz4_legacy_decode(oldrd, ret, &in.buf);
+	else
+		ret = gunzip_ramdisk(oldrd, ret, &in.buf);
+	if (ret <= 0) {
+		rprint("Error decompressing ramdisk!");
+		ret = ret ? ret : -EINVAL;
 		goto out;
 	}
+	in.pos = 0;
+	in.len = ret;
 
 	file_list_init(&read_files);
-	pthread_create(&decomp_th, NULL, decompress_thread, (void *)&decomp);
+	pthread_create(&decomp_th, NULL, decompress_thread, (void *)&in);
 #ifndef __ANDROID__
 	mod_prio(decomp_th, SCHED_BATCH);
 #endif
 
 	/* Start compression */
-	comp.zalloc = Z_NULL;
-	comp.zfree = Z_NULL;
-	comp.opaque = Z_NULL;
-	comp.avail_out = RAMDISK_SIZE;
-	rdbuf = malloc(RAMDISK_SIZE);
-	comp.next_out = (uint8_t *)rdbuf;
-
-	if (!comp.next_out) {
-		rprint("Out of memory?!");
-		ret = -ENOMEM;
-		goto out;
-	}
-
-	if (ret = deflateInit2(&comp, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
-		31, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+	out.pd = NULL;
+	out.bd = NULL;
+	out.lz = NULL;
+	out.cls = RD_DEFAULT;
+	out.total = in.len;
+	/* An old LZ4 ramdisk says little about gzip's ratio */
+	out.old = oldlz ? 0 : oldlen;
+	out.level = oldlz ? 6 : rd_start_level(ramdisk_budget(), oldlen);
+#ifndef RAMDISK_LZ4
+	if (ramdisk_want_lz4())
+#endif
+		out.lz = lz4w_init(stream_ramdisk);
+#ifdef RAMDISK_ONESHOT
+	if (!out.lz && !(out.bd = bdeflate_init(stream_ramdisk))) {
+#else
+	if (!out.lz && !(out.pd = pdeflate_init(out.level, stream_ramdisk))) {
+#endif
 		rprint("Error starting compression!");
+		ret = -ENOMEM;
 		goto out;
 	}
-
+	if (out.lz)
+		rprint("Using LZ4 ramdisk compression");
+	/* Only an archive in the right format can be passed through */
+	out.src = !out.lz == !oldlz ? in.buf : NULL;
+
+	/* Keep system/ extraction off the CPUs compression needs, until we
+	 * return
+	 */
+	system_throttle(1);
 	file_list_init(&write_files);
-	pthread_create(&comp_th, NULL, compress_thread, (void *)&comp);
+	pthread_create(&comp_th, NULL, compress_thread, (void *)&out);
 
 	/* Start passing files */
-	ramdisk_init_overrides();
 	if (ret = override_thread()) {
 		rprint("Ramdisk patching failed!");
 		goto out;
@@ -433,19 +879,43 @@ void *generate_ramdisk(void *arg) {
 		rprint("Pthreads exploded!");
 		goto out;
 	}
-	if (thread_ret) {
+	if ((long)thread_ret < 0) {
 		ret = (long)thread_ret;
 		rprint("Compression failed!");
 		goto out;
 	}
 
+#ifndef RECOVERY_BUILD
+	{
+		unsigned int count;
+		unsigned long stall_ms;
+
+		ramdisk_override_stats(&count, &stall_ms);
+		printf("%s: %u deferred, %lu ms stalled on overrides\n",
+			__func__, count, stall_ms);
+	}
+	printf("%s: read_files: %u pushed, %u/%u push/pop sleeps\n",
+		__func__, read_files.pushed, read_files.push_sleeps,
+		read_files.pop_sleeps);
+	printf("%s: write_files: %u pushed, %u/%u push/pop sleeps\n",
+		__func__, write_files.pushed, write_files.push_sleeps,
+		write_files.pop_sleeps);
+#endif
+
 	/* Wait until compression finishes before freeing */
 	ramdisk_free_overrides();
-	free(oldrd);
+	cpio_arena_free();
+	free(in.buf);
 
-	rprint("Compressed new ramdisk");
-	add_ramdisk(rdbuf, RAMDISK_SIZE - comp.avail_out);
+	if (thread_ret) {
+		rprint("Compressed new ramdisk");
+		ret = add_ramdisk(NULL, (long)thread_ret);
+	} else {
+		rprint("Ramdisk unchanged, reusing it");
+		ret = add_ramdisk(oldrd, oldlen);
+	}
 
 out:
+	system_throttle(0);
 	return (void *)ret;
 }
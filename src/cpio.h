@@ -7,12 +7,18 @@
 
 #include <pthread.h>
 
-/* To (maybe) keep malloc performant, we use a single allocation size.  We aim
- * for a reasonably-sized power-of-two allocation, less a few bytes for malloc
- * overhead.
+/* Ramdisk arena
+ * cpio_ents and file_chunks are carved out of large slabs, sized to what they
+ * actually hold.  Nothing is freed individually; the whole arena is released
+ * in one go once the new ramdisk has been compressed.  We aim for a
+ * reasonably-sized power-of-two slab, less a few bytes for malloc overhead.
+ * Anything too big to share a slab gets one to itself.
  */
 #define ALLOC_CHUNK_SZ (1020*64)
 
+void *cpio_arena_alloc(unsigned long size);
+void cpio_arena_free(void);
+
 /* cpio header and related functions
  * Very little manipulation is actually needed here.
  */
@@ -40,60 +46,72 @@ struct cpio_hdr {
 /* cpio header manipulation:
  * xtol: convert 8-byte string to long
  * ltox: write long to 8-byte header member
- * nudge_ino: write a unique inode to header
+ * nudge_ino: write a unique inode to header, returning whether it changed
  */
 unsigned long xtol(char *arg) __attribute__((pure));
 void ltox(char *p, unsigned long v);
-void nudge_ino(struct cpio_hdr *hdr);
+int nudge_ino(struct cpio_hdr *hdr);
 
 /* Generic chunked i/o
  * In order to make file patching easy, we need chunked i/o.  These are pretty
  * straightforward linked lists of buffers, with some magic to allow them to be
- * split.  __alloc determines whether this chunk will be automatically freed.
+ * split.
  *
- * NB: chunks are freed in reverse.  In a packed (ordered) file_chunk[],
- *     __alloc should only be set for the first chunk.
+ * file_chunk_alloc reserves size bytes of data directly behind the chunk.  To
+ * simplify padding, it overcommits to a multiple of 4 bytes, always leaving
+ * room for a terminating NUL.
  */
 struct file_chunk {
 	unsigned long len;
 	char *buf;
 	struct file_chunk *next;
-	int __alloc; /* should we free() this chunk? */
 };
-/* To simplify padding, overcommit and ensure we're a multiple of 4 bytes */
-#define CHUNK_DATA_SZ ((ALLOC_CHUNK_SZ-sizeof(struct file_chunk)-3)&~3)
+#define CHUNK_DATA_SZ(size) (((size)+4)&~3)
 
-struct file_chunk *file_chunk_alloc(struct file_chunk *c);
-void file_chunk_free(struct file_chunk *c);
+struct file_chunk *file_chunk_alloc(struct file_chunk *c, unsigned long size);
 
 /* cpio file entries
- * For simplicity, the header is contained inside this struct, but data is not.
- * __poison informs the compression thread to skip this entry.  cpio_ent_free
- * also frees any file_chunks associated with the entry.
+ * For simplicity, the header is chained in as the first data chunk.  Entries
+ * parsed from the old ramdisk are views: hdr and the body chunk point straight
+ * into the decoded archive, which must stay around (and writable) until
+ * compression is done.  Headers are edited in place; bodies must be unshared
+ * before they're modified, as must stored files mapped from the zip.
+ * __poison informs the compression thread to skip this entry.  Anything that
+ * changes an entry must set __dirty, so an untouched archive can be passed
+ * through without recompressing it.
  */
 struct cpio_ent {
-	struct cpio_ent *next;
-	/* data.buf = &hdr; data.next->buf = malloc(); */
+	/* data.buf = hdr; data.next->buf = file_chunk_alloc() or the archive */
 	struct file_chunk data;
-	struct cpio_hdr hdr;
 	int __poison; /* don't write this file */
+	int __shared; /* data.next->buf is read-only (archive or zip) */
+	int __dirty; /* differs from the archive */
+	struct cpio_hdr *hdr;
 };
 
-struct cpio_ent *cpio_ent_alloc(void);
-void cpio_ent_free(struct cpio_ent *e);
+struct cpio_ent *cpio_ent_alloc(unsigned long namesize);
+struct cpio_ent *cpio_ent_view(struct cpio_hdr *hdr, unsigned long namesize);
+struct file_chunk *cpio_ent_unshare(struct cpio_ent *e);
 
 /* cpio file lists
- * These are used to pass cpio_ents between threads.  Nothing fancy, just a
- * linked list with a mutex+condition for synchronization.
+ * These are used to pass cpio_ents between threads.  Each list has exactly
+ * one producer and one consumer, so a bounded ring with acquire/release
+ * indices is enough.  Threads spin briefly, then sleep on the mutex+condition
+ * only when the ring is full or empty.  The bound keeps the decompressor from
+ * running arbitrarily far ahead of the compressor.
  *
- * A spinlock would be ideal, but pthreads conditions require mutexes.
+ * head is only written by the producer, tail only by the consumer; keep them
+ * on separate cache lines.  Stats are for gauging hand-off cost.
  */
+#define FILE_LIST_LEN (64) /* must be a power of two */
 struct cpio_file_list {
-	//pthread_spinlock_t lock;
+	struct cpio_ent *ring[FILE_LIST_LEN];
+	unsigned int head, pushed, push_sleeps;
+	unsigned int tail __attribute__((aligned(64)));
+	unsigned int pop_sleeps;
+	int waiting __attribute__((aligned(64)));
 	pthread_mutex_t lock;
 	pthread_cond_t cond;
-	struct cpio_ent *head;
-	struct cpio_ent *tail;
 };
 
 extern struct cpio_file_list read_files, write_files;
@@ -102,9 +120,59 @@ int file_list_init(struct cpio_file_list *l);
 void file_list_push(struct cpio_file_list *l, struct cpio_ent *e);
 struct cpio_ent *file_list_pop(struct cpio_file_list *l);
 
+/* Parallel gzip compression (pdeflate.c)
+ * Compressors don't own an output buffer: everything they produce is passed,
+ * in order, to the emit callback given at init, and a nonzero return from
+ * emit fails the compression.  pdeflate_params changes the level and strategy
+ * for everything written after it.  pdeflate_progress reports how much input
+ * has been compressed so far, and what it came to.
+ *
+ * pdeflate_finish returns the compressed size, and also cleans up after a
+ * failed pdeflate_write.
+ */
+struct pdeflate;
+struct pdeflate *pdeflate_init(int level,
+	int (*emit)(const char *buf, unsigned long len));
+void pdeflate_params(struct pdeflate *pd, int level, int strategy);
+int pdeflate_write(struct pdeflate *pd, const char *buf, unsigned long len);
+void pdeflate_progress(struct pdeflate *pd, unsigned long *in,
+	unsigned long *out);
+long pdeflate_finish(struct pdeflate *pd);
+
+/* Whole-buffer gzip compression (bdeflate.c)
+ * Input is buffered until bdeflate_finish, which compresses it all at once
+ * and returns the compressed size.  bdeflate_finish also cleans up after a
+ * failed bdeflate_write.
+ */
+struct bdeflate;
+struct bdeflate *bdeflate_init(int (*emit)(const char *buf, unsigned long len));
+int bdeflate_write(struct bdeflate *bd, const char *buf, unsigned long len);
+long bdeflate_finish(struct bdeflate *bd);
+
+/* LZ4 (lz4.c)
+ * Block codec plus the legacy frame format used by the kernel's initramfs
+ * unpacker.  lz4w_finish returns the compressed size, and also cleans up
+ * after a failed lz4w_write.
+ */
+#define LZ4_LEGACY_MAGIC (0x184c2102)
+#define LZ4_LEGACY_BLOCK (8*1024*1024)
+#define LZ4_BOUND(len) ((len) + (len) / 255 + 16)
+long lz4_compress(const char *src, unsigned long len, char *dst,
+	unsigned long dst_size);
+long lz4_decompress(const char *src, unsigned long len, char *dst,
+	unsigned long dst_size);
+int lz4_is_legacy(const char *buf, unsigned long len);
+long lz4_legacy_decode(const char *src, unsigned long len, char **out);
+struct lz4w;
+struct lz4w *lz4w_init(int (*emit)(const char *buf, unsigned long len));
+int lz4w_write(struct lz4w *w, const char *buf, unsigned long len);
+long lz4w_finish(struct lz4w *w);
+
 /* Get the patch/replace/insert logic out of the cpio guts. */
-int ramdisk_init_overrides(void);
 int ramdisk_handle_overrides(struct cpio_ent *e);
+void ramdisk_flush_deferred(void);
+void ramdisk_override_stats(unsigned int *count, unsigned long *stall_ms);
+int ramdisk_want_lz4(void);
 void ramdisk_free_overrides(void);
 
 #endif /* _IM_CPIO_H */
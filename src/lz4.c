@@ -0,0 +1,338 @@
+#include <unistd.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <sys/types.h>
+
+#include "common.h"
+#include "cpio.h"
+
+/* LZ4 block codec
+ * A small greedy encoder in the spirit of LZ4_compress_fast, and a bounds-
+ * checked decoder.  The encoder honors the format's end-of-block rules: the
+ * last LZ4_LASTLITERALS bytes are always literals, and no match starts within
+ * LZ4_MFLIMIT bytes of the end.
+ */
+#define LZ4_MINMATCH (4)
+#define LZ4_LASTLITERALS (5)
+#define LZ4_MFLIMIT (12)
+#define LZ4_MAX_OFFSET (65535)
+#define LZ4_HASH_LOG (14)
+
+static inline uint32_t lz4_read32(const uint8_t *p) {
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+static inline uint32_t lz4_hash(uint32_t v) {
+	return (v * 2654435761U) >> (32 - LZ4_HASH_LOG);
+}
+static uint8_t *lz4_put_len(uint8_t *op, unsigned long len) {
+	for (; len >= 255; len -= 255)
+		*op++ = 255;
+	*op++ = len;
+	return op;
+}
+
+/* lz4_compress:
+ * Compress a single block.  Returns the compressed size, or -ENOSPC if it
+ * doesn't fit in dst.  LZ4_BOUND(len) is always enough.
+ */
+long lz4_compress(const char *src, unsigned long len, char *dst,
+		unsigned long dst_size) {
+	const uint8_t *base = (const uint8_t *)src;
+	const uint8_t *ip = base, *anchor = base, *ref;
+	const uint8_t *iend = base + len, *mflimit, *matchlimit;
+	uint8_t *op = (uint8_t *)dst, *oend = op + dst_size, *token;
+	uint32_t *table;
+	unsigned long lit, mlen;
+	unsigned int h, miss = 0;
+
+	if (!(table = calloc(1 << LZ4_HASH_LOG, sizeof(uint32_t))))
+		return -ENOMEM;
+
+	/* Tiny blocks are all literals */
+	mflimit = len > LZ4_MFLIMIT ? iend - LZ4_MFLIMIT : base;
+	matchlimit = iend - LZ4_LASTLITERALS;
+	while (ip < mflimit) {
+		h = lz4_hash(lz4_read32(ip));
+		ref = base + table[h];
+		table[h] = ip - base;
+		if (ref >= ip || ip - ref > LZ4_MAX_OFFSET ||
+			lz4_read32(ref) != lz4_read32(ip)) {
+			/* Skip faster through incompressible data */
+			ip += 1 + (miss++ >> 6);
+			continue;
+		}
+		miss = 0;
+
+		/* Extend backwards, then forwards */
+		while (ip > anchor && ref > base && ip[-1] == ref[-1]) {
+			ip--;
+			ref--;
+		}
+		for (mlen = LZ4_MINMATCH; ip + mlen < matchlimit &&
+			ip[mlen] == ref[mlen]; mlen++);
+
+		lit = ip - anchor;
+		if (oend - op < lit + lit / 255 + mlen / 255 + 6)
+			goto nospc;
+		token = op++;
+		if (lit >= 15) {
+			*token = 15 << 4;
+			op = lz4_put_len(op, lit - 15);
+		} else {
+			*token = lit << 4;
+		}
+		memcpy(op, anchor, lit);
+		op += lit;
+		*op++ = (ip - ref) & 0xff;
+		*op++ = (ip - ref) >> 8;
+		if (mlen - LZ4_MINMATCH >= 15) {
+			*token |= 15;
+			op = lz4_put_len(op, mlen - LZ4_MINMATCH - 15);
+		} else {
+			*token |= mlen - LZ4_MINMATCH;
+		}
+
+		ip += mlen;
+		anchor = ip;
+		if (ip < mflimit)
+			table[lz4_hash(lz4_read32(ip - 2))] = ip - 2 - base;
+	}
+
+	/* Trailing literals */
+	lit = iend - anchor;
+	if (oend - op < lit + lit / 255 + 2)
+		goto nospc;
+	token = op++;
+	if (lit >= 15) {
+		*token = 15 << 4;
+		op = lz4_put_len(op, lit - 15);
+	} else {
+		*token = lit << 4;
+	}
+	memcpy(op, anchor, lit);
+	op += lit;
+
+	free(table);
+	return (char *)op - dst;
+
+nospc:
+	free(table);
+	return -ENOSPC;
+}
+
+/* lz4_decompress:
+ * Decompress a single block.  Returns the decompressed size, or -EINVAL if
+ * the block is corrupt or doesn't fit in dst.
+ */
+long lz4_decompress(const char *src, unsigned long len, char *dst,
+		unsigned long dst_size) {
+	const uint8_t *ip = (const uint8_t *)src, *iend = ip + len;
+	uint8_t *op = (uint8_t *)dst, *oend = op + dst_size;
+	const uint8_t *ref;
+	unsigned long lit, mlen, off;
+	unsigned int token, b;
+
+	while (ip < iend) {
+		token = *ip++;
+		lit = token >> 4;
+		if (lit == 15) {
+			do {
+				if (ip >= iend)
+					return -EINVAL;
+				lit += b = *ip++;
+			} while (b == 255);
+		}
+		if (lit > iend - ip || lit > oend - op)
+			return -EINVAL;
+		memcpy(op, ip, lit);
+		ip += lit;
+		op += lit;
+
+		/* The last sequence has no match */
+		if (ip == iend)
+			break;
+
+		if (iend - ip < 2)
+			return -EINVAL;
+		off = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if (!off || off > op - (uint8_t *)dst)
+			return -EINVAL;
+		mlen = token & 15;
+		if (mlen == 15) {
+			do {
+				if (ip >= iend)
+					return -EINVAL;
+				mlen += b = *ip++;
+			} while (b == 255);
+		}
+		mlen += LZ4_MINMATCH;
+		if (mlen > oend - op)
+			return -EINVAL;
+
+		/* Matches may overlap their own output */
+		ref = op - off;
+		if (off >= mlen) {
+			memcpy(op, ref, mlen);
+			op += mlen;
+		} else {
+			while (mlen--)
+				*op++ = *ref++;
+		}
+	}
+
+	return (char *)op - dst;
+}
+
+/* LZ4 legacy frames
+ * This is what the kernel's initramfs unpacker (and lz4 -l) understands: a
+ * magic number, then blocks of up to 8MB, each preceded by its compressed
+ * size.  There is no end marker and no checksum.
+ *
+ * The writer buffers a full block before compressing it.
+ */
+struct lz4w {
+	char *blk, *out;
+	unsigned long len, total;
+	int (*emit)(const char *buf, unsigned long len);
+};
+
+static void lz4_put32(char *p, uint32_t v) {
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+static uint32_t lz4_get32(const char *p) {
+	const uint8_t *u = (const uint8_t *)p;
+	return u[0] | (u[1] << 8) | (u[2] << 16) | ((uint32_t)u[3] << 24);
+}
+
+int lz4_is_legacy(const char *buf, unsigned long len) {
+	return len >= 4 && lz4_get32(buf) == LZ4_LEGACY_MAGIC;
+}
+
+/* lz4w_init:
+ * Each block is compressed into out, behind its length, and handed to emit.
+ */
+struct lz4w *lz4w_init(int (*emit)(const char *buf, unsigned long len)) {
+	struct lz4w *w;
+
+	if (!(w = malloc(sizeof(struct lz4w))))
+		return NULL;
+	w->blk = malloc(LZ4_LEGACY_BLOCK);
+	w->out = malloc(LZ4_BOUND(LZ4_LEGACY_BLOCK) + 4);
+	if (!w->blk || !w->out)
+		goto fail;
+	w->len = 0;
+	w->emit = emit;
+	lz4_put32(w->out, LZ4_LEGACY_MAGIC);
+	if (emit(w->out, 4))
+		goto fail;
+	w->total = 4;
+	return w;
+
+fail:
+	free(w->blk);
+	free(w->out);
+	free(w);
+	return NULL;
+}
+
+static int lz4w_flush(struct lz4w *w) {
+	long ret;
+	int err;
+
+	if (!w->len)
+		return 0;
+	ret = lz4_compress(w->blk, w->len, w->out + 4,
+		LZ4_BOUND(LZ4_LEGACY_BLOCK));
+	if (ret < 0)
+		return ret;
+	lz4_put32(w->out, ret);
+	if (err = w->emit(w->out, ret + 4))
+		return err;
+	w->total += ret + 4;
+	w->len = 0;
+	return 0;
+}
+
+int lz4w_write(struct lz4w *w, const char *buf, unsigned long len) {
+	unsigned long cnt;
+	int ret;
+
+	while (len) {
+		cnt = LZ4_LEGACY_BLOCK - w->len;
+		if (cnt > len)
+			cnt = len;
+		memcpy(w->blk + w->len, buf, cnt);
+		w->len += cnt;
+		buf += cnt;
+		len -= cnt;
+		if (w->len == LZ4_LEGACY_BLOCK && (ret = lz4w_flush(w)))
+			return ret;
+	}
+	return 0;
+}
+
+long lz4w_finish(struct lz4w *w) {
+	long ret;
+
+	if (!(ret = lz4w_flush(w)))
+		ret = w->total;
+	free(w->blk);
+	free(w->out);
+	free(w);
+	return ret;
+}
+
+/* lz4_legacy_decode:
+ * Decode a whole legacy stream into a freshly allocated buffer.  Trailing
+ * zero padding is ignored.  Returns the decoded size, or -errno.
+ */
+long lz4_legacy_decode(const char *src, unsigned long len, char **out) {
+	unsigned long pos = 4, olen = 0, blk;
+	char *buf = NULL, *n;
+	long ret;
+
+	if (!lz4_is_legacy(src, len))
+		return -EINVAL;
+
+	while (len - pos >= 4) {
+		blk = lz4_get32(src + pos);
+		if (!blk)
+			break;
+		pos += 4;
+		/* Concatenated streams repeat the magic */
+		if (blk == LZ4_LEGACY_MAGIC)
+			continue;
+		if (blk > len - pos) {
+			ret = -EINVAL;
+			goto fail;
+		}
+		if (!(n = realloc(buf, olen + LZ4_LEGACY_BLOCK))) {
+			ret = -ENOMEM;
+			goto fail;
+		}
+		buf = n;
+		ret = lz4_decompress(src + pos, blk, buf + olen,
+			LZ4_LEGACY_BLOCK);
+		if (ret < 0)
+			goto fail;
+		olen += ret;
+		pos += blk;
+	}
+
+	/* Give back the slack from the last block */
+	if (olen && (n = realloc(buf, olen)))
+		buf = n;
+	*out = buf;
+	return olen;
+
+fail:
+	free(buf);
+	return ret;
+}
@@ -5,6 +5,7 @@
 #include <signal.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/resource.h>
 
 #include "common.h"
 #include <zlib.h>
@@ -24,6 +25,16 @@ static void *(*const thread_funcs[])(void *) = {
 	[THREAD_GENSPLASH] = generate_splash,
 	[THREAD_RAMDISK] = generate_ramdisk,
 };
+static int thread_finished[THREAD_COUNT];
+
+/* Every thread starts here, so thread_done can tell when it's returned */
+static void *thread_main(void *arg) {
+	long slot = (long)arg;
+	void *ret = thread_funcs[slot](NULL);
+
+	__atomic_store_n(&thread_finished[slot], 1, __ATOMIC_RELEASE);
+	return ret;
+}
 
 void mod_prio(pthread_t thread, int new_pol) {
 	struct sched_param param;
@@ -37,6 +48,9 @@ int main(int argc, char **argv) {
 	struct stat check_zip;
 	int i;
 	pthread_attr_t th_attr;
+#ifndef RECOVERY_BUILD
+	struct rusage usage;
+#endif
 
 #ifdef RECOVERY_BUILD
 	if (argc != 4 || stat(argv[3], &check_zip) == -1)
@@ -58,13 +72,19 @@ int main(int argc, char **argv) {
 	get_crc_table();
 	signal(SIGPIPE, SIG_IGN);
 
+	if (ret = zip_index_open(zip_path)) {
+		rprint("Can't open zip!");
+		goto just_die;
+	}
+
 	pthread_attr_init(&th_attr);
 	pthread_attr_setdetachstate(&th_attr, PTHREAD_CREATE_JOINABLE);
 
 	pthread_mutex_lock(&thread_lock);
 
 	for (i = THREAD_COUNT - 1; i >= 0; i--) {
-		ret = pthread_create(&threads[i], &th_attr, thread_funcs[i], NULL);
+		ret = pthread_create(&threads[i], &th_attr, thread_main,
+			(void *)(long)i);
 		if (ret)
 			goto abort_cancel_and_die;
 	}
@@ -83,6 +103,10 @@ int main(int argc, char **argv) {
 
 	rprint("Completing installation");
 	ret = wait_thread(THREAD_SYSTEM);
+#ifndef RECOVERY_BUILD
+	if (!getrusage(RUSAGE_SELF, &usage))
+		printf("%s: peak RSS %li KB\n", __func__, usage.ru_maxrss);
+#endif
 
 	return -ret;
 
@@ -98,6 +122,13 @@ just_die:
 	return -ret;
 }
 
+/* thread_done:
+ * Has the thread finished, i.e. would wait_thread return without blocking?
+ */
+int thread_done(enum thread_slot slot) {
+	return __atomic_load_n(&thread_finished[slot], __ATOMIC_ACQUIRE);
+}
+
 int wait_thread(enum thread_slot slot) {
 	long retval;
 	int join_ret;
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <unistd.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -7,7 +8,6 @@
 
 #include "common.h"
 #include "cpio.h"
-#include <zlib/contrib/minizip/unzip.h>
 
 #include <stdio.h>
 
@@ -16,6 +16,7 @@
 enum override_flags {
 	OVER_CREATE = 1<<0, /* create if (apparently) missing */
 	OVER_POISON = 1<<1, /* duplicate; don't compress */
+	OVER_ASYNC = 1<<2, /* filled in by producer; defer until it's done */
 };
 struct ramdisk_override {
 	const char	*name;
@@ -24,6 +25,8 @@ struct ramdisk_override {
 	int 		flags;
 	char		*buf;
 	unsigned int	size;
+	struct file_chunk *chunks; /* instead of buf */
+	enum thread_slot producer; /* for OVER_ASYNC */
 };
 
 /* ramdisk file overrides:
@@ -39,63 +42,118 @@ static struct ramdisk_override overrides[] = {
 	{ "init.rc", patch_initrc },
 	{ "init.superuser.rc", check_zip, OVER_CREATE },
 	//{ "init.target.rc", check_zip },
-	{ "initlogo.rle", wait_for_gensplash },
+	{ "initlogo.rle", wait_for_gensplash, OVER_ASYNC,
+		.producer = THREAD_GENSPLASH },
 	{ "mpdecision", check_zip, OVER_CREATE },
 	{ NULL }
 };
 
-static unzFile zip;
-
 /* ramdisk_push_override:
  * Provide a buffer for later overriding.  No synchronization is done.
  * Currently, splash screen generation is the only consumer, and wait_thread()
  * is sufficient.
  */
-int ramdisk_push_override(char *name, char *buf, unsigned int size) {
+static struct ramdisk_override *find_override(char *name) {
 	struct ramdisk_override *rdo = overrides;
 	while (rdo->name) {
-		if (!strcmp(name, rdo->name)) {
-			if (rdo->buf) return -EBUSY;
-			rdo->buf = buf;
-			rdo->size = size;
-			return 0;
-		}
+		if (!strcmp(name, rdo->name))
+			return rdo->buf || rdo->chunks ? NULL : rdo;
 		rdo++;
 	}
-
-	return -ENOENT;
+	return NULL;
+}
+int ramdisk_push_override(char *name, char *buf, unsigned int size) {
+	struct ramdisk_override *rdo = find_override(name);
+	if (!rdo) return -EBUSY;
+	rdo->buf = buf;
+	rdo->size = size;
+	return 0;
+}
+int ramdisk_push_override_chunks(char *name, struct file_chunk *chunks) {
+	struct ramdisk_override *rdo = find_override(name);
+	struct file_chunk *c;
+	if (!rdo) return -EBUSY;
+	rdo->chunks = chunks;
+	for (rdo->size = 0, c = chunks; c; c = c->next)
+		rdo->size += c->len;
+	return 0;
 }
 
-/* ramdisk_init_overrides:
- * Handle any preparation needed for overriding files.  Currently, that means
- * opening the install zip for check_zip().
+/* ramdisk_want_lz4:
+ * The install zip asks for an LZ4 ramdisk by including ZIPLZ4.
  */
-int ramdisk_init_overrides(void) {
-	int ret = 0;
-	if (!(zip = unzOpen(zip_path))) {
-		ret = -ENOENT;
-		goto out;
-	}
-
-out:
-	return ret;
+int ramdisk_want_lz4(void) {
+	return zip_find(ZIPLZ4) != NULL;
 }
 
 /* ramdisk_free_overrides:
- * Clean up data used for overriding files.  Currently, that means closing the
- * install zip and freeing any buffers not freed by the compression thread.
+ * Clean up data used for overriding files.  Currently, that means freeing any
+ * buffers not freed by the compression thread.
  */
 void ramdisk_free_overrides(void) {
 	struct ramdisk_override *rdo = overrides;
 
+	struct file_chunk *c;
+
 	while (rdo->name) {
 		if (rdo->buf)
 			free(rdo->buf);
 		rdo->buf = NULL;
+		while (c = rdo->chunks) {
+			rdo->chunks = c->next;
+			free(c);
+		}
 		rdo++;
 	}
+}
 
-	unzClose(zip);
+/* Deferred entries
+ * An OVER_ASYNC entry whose producer is still running is held back, rather
+ * than stalling the whole pipeline on it.  Order within the archive doesn't
+ * matter to the kernel, so ramdisk_flush_deferred hands them over just ahead
+ * of the trailer.  Stall time is however long override_thread spent blocked
+ * in an OVER_ASYNC get_func.
+ */
+#define DEFER_MAX (4)
+static struct {
+	struct cpio_ent *e;
+	struct ramdisk_override *o;
+} deferred[DEFER_MAX];
+static unsigned int deferred_count;
+static unsigned long long stall_ns;
+
+static int run_async(struct cpio_ent *e, struct ramdisk_override *o) {
+	struct timespec t0, t1;
+	int ret;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	ret = o->get_func(e, o);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	stall_ns += (t1.tv_sec - t0.tv_sec) * 1000000000ULL +
+		t1.tv_nsec - t0.tv_nsec;
+	return ret;
+}
+
+/* ramdisk_flush_deferred:
+ * Finish off deferred entries, waiting on their producers, and pass them to
+ * the compression thread.  Call just before the trailer.
+ */
+void ramdisk_flush_deferred(void) {
+	unsigned int i;
+
+	for (i = 0; i < deferred_count; i++) {
+		if (run_async(deferred[i].e, deferred[i].o) < 0)
+			rprint("File patching failed, ignoring!");
+		file_list_push(&write_files, deferred[i].e);
+	}
+}
+
+/* ramdisk_override_stats:
+ * How many entries were deferred, and how long we stalled on producers.
+ */
+void ramdisk_override_stats(unsigned int *count, unsigned long *stall_ms) {
+	*count = deferred_count;
+	*stall_ms = stall_ns / 1000000;
 }
 
 /* insert_file:
@@ -104,14 +162,14 @@ void ramdisk_free_overrides(void) {
  */
 int insert_file(struct ramdisk_override *o) {
 	int ret;
-	struct cpio_ent *e = cpio_ent_alloc();
+	struct cpio_ent *e = cpio_ent_alloc(strlen(o->name) + 1);
 	if (!e) {
 		rprint("Allocation failed!");
 		return -ENOMEM;
 	}
 
 	/* Populate the header */
-	memcpy(&e->hdr,
+	memcpy(e->hdr,
 		/* magic */	"070701"
 		/* ino */	"00000001"
 		/* mode */	"00000000"
@@ -128,19 +186,18 @@ int insert_file(struct ramdisk_override *o) {
 		/* chksum */	"00000000"
 		, CPIO_HDR_LEN);
 	// compress thread populates ino, but must already be non-zero
-	ltox(e->hdr.mode, 0100750);
-	//ltox(e->hdr.mtime, (unsigned long)time(NULL));
-	ltox(e->hdr.namesize, strlen(o->name) + 1);
+	ltox(e->hdr->mode, 0100750);
+	//ltox(e->hdr->mtime, (unsigned long)time(NULL));
+	ltox(e->hdr->namesize, strlen(o->name) + 1);
 	// get_func populates size
-	strcpy(e->hdr.name, o->name);
+	strcpy(e->hdr->name, o->name);
 	e->data.len = CPIO_HDR_LEN + strlen(o->name) + 1;
 
+	/* On failure, e is simply left in the arena */
 	ret = o->get_func(e, o);
 	if (!ret) {
 		file_list_push(&write_files, e);
 		o->flags |= OVER_POISON;
-	} else {
-		cpio_ent_free(e);
 	}
 	return ret;
 }
@@ -148,21 +205,23 @@ int insert_file(struct ramdisk_override *o) {
 /* ramdisk_handle_overrides:
  * Check overrides[] for any appropriate override functions.  If a file is
  * "missing" (i.e. strcmp shows we've passed its assumed location), use
- * insert_file to create it.
+ * insert_file to create it.  Returns 1 if e was deferred; the caller must not
+ * pass it on.
  */
 int ramdisk_handle_overrides(struct cpio_ent *e) {
 	int ret;
 	int cmp;
+	int defer = 0;
 	struct ramdisk_override *rdo = overrides;
 
 	/* For bizarre ramdisks, don't add files before the . entry. */
-	if (!strcmp(e->hdr.name, "."))
+	if (!strcmp(e->hdr->name, "."))
 		return 0;
 
 	while (rdo->name) {
 		ret = 0;
 
-		cmp = strcmp(e->hdr.name, rdo->name);
+		cmp = strcmp(e->hdr->name, rdo->name);
 		if (cmp < 0) {
 			rdo++;
 			continue;
@@ -178,6 +237,16 @@ int ramdisk_handle_overrides(struct cpio_ent *e) {
 		} else {
 			if (rdo->flags & OVER_POISON) {
 				e->__poison = 1;
+			} else if (rdo->flags & OVER_ASYNC && !defer &&
+				   deferred_count < DEFER_MAX &&
+				   !thread_done(rdo->producer)) {
+				deferred[deferred_count].e = e;
+				deferred[deferred_count++].o = rdo;
+				rdo->flags |= OVER_POISON;
+				defer = 1;
+			} else if (rdo->flags & OVER_ASYNC) {
+				ret = run_async(e, rdo);
+				rdo->flags |= OVER_POISON;
 			} else if (rdo->get_func) {
 				ret = rdo->get_func(e, rdo);
 				rdo->flags |= OVER_POISON;
@@ -192,15 +261,25 @@ int ramdisk_handle_overrides(struct cpio_ent *e) {
 		}
 	}
 	//return ret < 0 ? ret : 0;
-	return 0;
+	return defer;
+}
+
+/* Does a chain of chunks hold exactly buf? */
+static int chunks_equal(const struct file_chunk *c, const char *buf,
+		unsigned long len) {
+	for (; c; buf += c->len, len -= c->len, c = c->next)
+		if (c->len > len || memcmp(c->buf, buf, c->len))
+			return 0;
+	return !len;
 }
 
 /* wait_for_gensplash:
- * Wait for the splash thread to complete, then (maybe) attach its buffer.
+ * Wait for the splash thread to complete, then (maybe) attach its buffer or
+ * chunks.
  */
 static int wait_for_gensplash(struct cpio_ent *e, struct ramdisk_override *o) {
 	int ret;
-	struct file_chunk *c, *s;
+	struct file_chunk *c;
 
 	if (ret = wait_thread(THREAD_GENSPLASH)) {
 		rprint("Not writing splash screen");
@@ -208,33 +287,43 @@ static int wait_for_gensplash(struct cpio_ent *e, struct ramdisk_override *o) {
 		//return ret;
 	}
 
-	s = e->data.next;
-	if (!(c = file_chunk_alloc(&e->data))) {
+	/* Same splash as last time? */
+	if ((c = e->data.next) && c->len == o->size && (o->chunks ?
+		chunks_equal(o->chunks, c->buf, c->len) :
+		!memcmp(c->buf, o->buf, o->size)))
+		return 0;
+
+	if (o->chunks) {
+		e->data.next = o->chunks;
+	} else if (c = file_chunk_alloc(&e->data, 0)) {
+		c->buf = o->buf;
+		c->len = o->size;
+	} else {
 		rprint("Allocation failed!");
-		e->data.next = s;
 		return -ENOMEM;
 	}
-	file_chunk_free(s);
-
-	ltox(e->hdr.size, o->size);
 
-	c->buf = o->buf;
-	c->len = o->size;
+	ltox(e->hdr->size, o->size);
+	e->__shared = 0;
+	e->__dirty = 1;
 
 	return 0;
 }
 
 /* check_zip:
- * Look for a file in rd/ inside the install zip.
+ * Look for a file in rd/ inside the install zip.  A stored file is used in
+ * place, read-only like the archive; a deflated one is inflated straight
+ * into o->buf.
  */
 static int check_zip(struct cpio_ent *e, struct ramdisk_override *o) {
-	unz_file_info info;
-	int len, r, ret = 0;
+	const struct zip_entry *ze;
+	const char *map = NULL;
+	int ret;
 	char zipf[40] = "rd/";
 	struct file_chunk *c, *s;
 
 	strcat(zipf, o->name);
-	if (unzLocateFile(zip, zipf, 1) != UNZ_OK) {
+	if (!(ze = zip_find(zipf))) {
 		//rprint("File missing from zip!");
 		//return -ENOENT;
 #ifndef RECOVERY_BUILD
@@ -244,62 +333,51 @@ static int check_zip(struct cpio_ent *e, struct ramdisk_override *o) {
 		return 1;
 	}
 
-	if (unzGetCurrentFileInfo(zip, &info, NULL, 0, NULL, 0, NULL, 0)
-		!= UNZ_OK)
-		return -EFAULT;
 	s = e->data.next;
-	if (!(c = file_chunk_alloc(&e->data)))
+	if (!(c = file_chunk_alloc(&e->data, 0)))
 		return -ENOMEM;
-	if (!(o->buf = malloc(info.uncompressed_size))) {
-		ret = -ENOMEM;
-		goto out;
-	}
-	//o->size = info.uncompressed_size;
-
-	if (unzOpenCurrentFile(zip) != UNZ_OK) {
-		ret = -EFAULT;
-		goto out;
-	}
-
-	for (len = 0; len < info.uncompressed_size; ) {
-		r = unzReadCurrentFile(zip, o->buf + len,
-			info.uncompressed_size - len);
-		if (r > 0) {
-			len += r;
-			continue;
+	if ((ret = zip_map(ze, &map)) == -EINVAL) {
+		if (!(o->buf = malloc(ze->usize ? ze->usize : 1))) {
+			ret = -ENOMEM;
+			goto out;
 		}
-		if (r < 0) ret = -EFAULT;
-		break;
+		//o->size = ze->usize;
+		ret = zip_extract(ze, o->buf);
+		map = o->buf;
 	}
 
-	if (len < info.uncompressed_size)
-		ret = -EBADF;
-	if (unzCloseCurrentFile(zip) == UNZ_CRCERROR)
-		ret = -EBADF;
-
 out:
 	if (ret) {
 		rprint("Error reading zipped file!");
 		free(o->buf);
 		o->buf = NULL;
 		e->data.next = s;
+	} else if (s && s->len == ze->usize &&
+		!memcmp(s->buf, map, s->len)) {
+		/* Already up to date */
+		free(o->buf);
+		o->buf = NULL;
+		e->data.next = s;
 	} else {
-		file_chunk_free(s);
-		c->buf = o->buf;
-		c->len = info.uncompressed_size;
-		ltox(e->hdr.size, c->len);
+		c->buf = (char *)map;
+		c->len = ze->usize;
+		ltox(e->hdr->size, c->len);
+		e->__shared = !o->buf;
+		e->__dirty = 1;
 	}
 	return ret;
 }
 
 /* patch_initrc:
- * Patch init.rc to include init.dkp.rc.
+ * Patch init.rc to include init.dkp.rc.  The body may still be a view into
+ * the archive, so it isn't NUL-terminated; stick to mem*().
  */
 #define IMPORTDKP "import /init.dkp.rc\n"
 #define IMPORTSU "import /init.superuser.rc\n"
 static int patch_initrc(struct cpio_ent *e, struct ramdisk_override *o) {
 	struct file_chunk *c, *s;
-	char *ptr, *last = NULL, *buf;
+	char *ptr, *last = NULL, *buf, *end;
+	char imports[sizeof(IMPORTSU IMPORTDKP)] = "";
 	int have_dkp = 0, have_su = 0;
 
 	if (!e->data.next) {
@@ -307,82 +385,100 @@ static int patch_initrc(struct cpio_ent *e, struct ramdisk_override *o) {
 		return -EINVAL;
 	}
 
-	/* Add a new (packed) chunk. */
-	s = e->data.next->next;
-	c = file_chunk_alloc(e->data.next);
-	if (!c) {
-		rprint("Out of memory?!");
-		e->data.next = s;
-		return 0;
-	}
-	/* Make sure we can return safely */
-	c[0].len = 0;
-	c[0].buf = (char *)&c[2];
-	c[0].next = &c[1];
-	c[1].len = 0;
-	c[1].buf = NULL;
-	c[1].next = s;
-	c[1].__alloc = 0;
-
-	/* Split the chunk after the final import line */
+	/* Find the final import line */
 	ptr = buf = e->data.next->buf;
-	while (ptr = strstr(ptr, "\nimport /")) {
+	end = buf + e->data.next->len;
+	while (ptr = memmem(ptr, end - ptr, "\nimport /",
+		strlen("\nimport /"))) {
 		/* While we're here, check which imports are present */
 		ptr += strlen("\nimport /");
-		if (!strncmp(ptr, "init.superuser.rc",
+		if (end - ptr >= strlen("init.superuser.rc") &&
+			!strncmp(ptr, "init.superuser.rc",
 			strlen("init.superuser.rc")))
 			have_su = 1;
-		else if (!strncmp(ptr, "init.dkp.rc",
+		else if (end - ptr >= strlen("init.dkp.rc") &&
+			!strncmp(ptr, "init.dkp.rc",
 			strlen("init.dkp.rc")))
 			have_dkp = 1;
 		last = ptr;
 	}
 	if (!last) return 0;
-	ptr = strchr(last, '\n');
+	ptr = memchr(last, '\n', end - last);
 	if (!ptr) return 0;
 	ptr++;
+
+	/* Build our import lines */
+	if (!have_su && zip_find("rd/init.superuser.rc"))
+		strcat(imports, IMPORTSU);
+	if (!have_dkp && zip_find("rd/init.dkp.rc"))
+		strcat(imports, IMPORTDKP);
+	if (!imports[0])
+		return 0;
+
+	/* Split the chunk after the final import line, and add a new (packed)
+	 * chunk: c[1] and the import lines ride along.
+	 */
+	s = e->data.next->next;
+	c = file_chunk_alloc(e->data.next,
+		sizeof(struct file_chunk) + strlen(imports));
+	if (!c) {
+		rprint("Out of memory?!");
+		return 0;
+	}
+	c[0].len = strlen(imports);
+	c[0].buf = (char *)&c[2];
+	c[0].next = &c[1];
+	memcpy(c[0].buf, imports, c[0].len);
+	c[1].len = end - ptr;
 	c[1].buf = ptr;
-	c[1].len = e->data.next->len - (ptr - buf);
+	c[1].next = s;
 	e->data.next->len = ptr - buf;
-
-	/* Built our import lines */
-	c[0].buf[0] = '\0';
-	if (!have_su && unzLocateFile(zip, "rd/init.superuser.rc", 1) == UNZ_OK)
-		strcat(c[0].buf, "import /init.superuser.rc\n");
-	if (!have_dkp && unzLocateFile(zip, "rd/init.dkp.rc", 1) == UNZ_OK)
-		strcat(c[0].buf, "import /init.dkp.rc\n");
-	c[0].len = strlen(c[0].buf);
-	ltox(e->hdr.size, xtol(e->hdr.size) + c[0].len);
+	ltox(e->hdr->size, xtol(e->hdr->size) + c[0].len);
+	e->__dirty = 1;
 
 	return 0;
 }
 
 /* patch_qcomrc:
  * Comment out the power save profile hook.  It's replaced in init.dkp.rc.
+ * Only unshare the body once there's actually a line to change.
  */
 #define PERFLINE "on property:sys.perf.profile="
 static int patch_qcomrc(struct cpio_ent *e, struct ramdisk_override *o) {
-	char *ptr;
+	struct file_chunk *c = e->data.next;
+	char *ptr, *end;
+	unsigned long off;
 
-	if (!e->data.next) {
+	if (!c) {
 		rprint("Missing init.qcom.rc data?!");
 		return -EINVAL;
 	}
 
-	ptr = strstr(e->data.next->buf, PERFLINE);
+	end = c->buf + c->len;
+	ptr = memmem(c->buf, c->len, PERFLINE, strlen(PERFLINE));
 	if (!ptr) return 0;
 
 	do {
-		ptr = strchr(ptr, '\n');
-		if (!ptr)
+		ptr = memchr(ptr, '\n', end - ptr);
+		if (!ptr || ++ptr == end)
 			break;
 
-		ptr++;
-		if (*ptr == ' ' || *ptr == '\t')
+		if (*ptr == ' ' || *ptr == '\t') {
+			if (e->__shared) {
+				off = ptr - c->buf;
+				if (!(c = cpio_ent_unshare(e))) {
+					rprint("Out of memory?!");
+					return -ENOMEM;
+				}
+				ptr = c->buf + off;
+				end = c->buf + c->len;
+			}
 			*ptr = '#';
-		else if (*ptr == '\r' || *ptr == '\n' || *ptr == '#')
+			e->__dirty = 1;
+		} else if (*ptr == '\r' || *ptr == '\n' || *ptr == '#')
 			continue;
-		else if (strncmp(ptr, PERFLINE, strlen(PERFLINE)))
+		else if (end - ptr < strlen(PERFLINE) ||
+			strncmp(ptr, PERFLINE, strlen(PERFLINE)))
 			break;
 	} while (1);
 
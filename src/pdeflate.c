@@ -0,0 +1,357 @@
+#include <unistd.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "common.h"
+#include "cpio.h"
+#include <zlib/zlib.h>
+
+/* Parallel gzip, pigz-style:
+ * The input stream is cut into PD_BLOCK_SZ blocks, each compressed as raw
+ * deflate by a worker thread.  Every block is primed with the preceding 32KB
+ * of input as a dictionary and ends on a sync flush, so the blocks can simply
+ * be concatenated.  The last block is finished normally, and the per-block
+ * CRCs are merged with crc32_combine.  The result is a single, ordinary gzip
+ * member.
+ *
+ * Jobs form a ring: the caller fills jobs[dispatched], workers take
+ * jobs[taken], and the caller collects jobs[collected] in order.
+ *
+ * pdeflate_params records a level/strategy change at the current input
+ * offset; each job carries the changes that fall within it as segments, and
+ * the worker applies them with deflateParams as it goes.
+ */
+#define PD_BLOCK_SZ (128*1024)
+#define PD_DICT_SZ (32*1024)
+#define PD_MAX_THREADS (8)
+#define PD_MAX_SEGS (16)
+
+struct pd_seg {
+	unsigned long off;
+	int level, strategy;
+};
+
+struct pd_job {
+	/* PD_DICT_SZ of dictionary (right-aligned), then up to PD_BLOCK_SZ of
+	 * input
+	 */
+	char *buf;
+	unsigned long dict, len;
+	struct pd_seg segs[PD_MAX_SEGS];
+	int nsegs;
+	char *out;
+	unsigned long out_len;
+	uLong crc;
+	int last;
+	int done; /* 0 while pending, 1 on success, -errno on failure */
+};
+
+struct pdeflate {
+	int level, strategy, nthreads, njobs;
+	pthread_t threads[PD_MAX_THREADS];
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int quit;
+	unsigned int dispatched, taken, collected;
+	struct pd_job *jobs;
+
+	int (*emit)(const char *buf, unsigned long len);
+	unsigned long dst_len;
+	uLong crc;
+	unsigned long isize;
+};
+
+#define pd_job_at(pd, n) (&(pd)->jobs[(n) % (pd)->njobs])
+
+static int pd_compress(z_stream *strm, struct pd_job *j) {
+	int ret, i;
+
+	if (deflateReset(strm) != Z_OK ||
+		deflateParams(strm, j->segs[0].level, j->segs[0].strategy) != Z_OK)
+		return -EFAULT;
+	if (j->dict && deflateSetDictionary(strm,
+		(uint8_t *)j->buf + PD_DICT_SZ - j->dict, j->dict) != Z_OK)
+		return -EFAULT;
+
+	strm->next_in = (uint8_t *)j->buf + PD_DICT_SZ;
+	strm->next_out = (uint8_t *)j->out;
+	strm->avail_out = PD_BLOCK_SZ + PD_BLOCK_SZ / 8 + 64;
+	for (i = 1; i < j->nsegs; i++) {
+		strm->avail_in = j->segs[i].off - j->segs[i - 1].off;
+		if (deflate(strm, Z_NO_FLUSH) != Z_OK || strm->avail_in ||
+			deflateParams(strm, j->segs[i].level,
+			j->segs[i].strategy) != Z_OK)
+			return -EFAULT;
+	}
+	strm->avail_in = j->len - j->segs[i - 1].off;
+	ret = deflate(strm, j->last ? Z_FINISH : Z_SYNC_FLUSH);
+	if (ret != (j->last ? Z_STREAM_END : Z_OK) ||
+		strm->avail_in || !strm->avail_out)
+		return -EFAULT;
+
+	j->out_len = (char *)strm->next_out - j->out;
+	j->crc = crc32(0, (uint8_t *)j->buf + PD_DICT_SZ, j->len);
+	return 1;
+}
+
+static void *pd_worker(void *arg) {
+	struct pdeflate *pd = arg;
+	struct pd_job *j;
+	z_stream strm;
+	int ret, done;
+
+	strm.zalloc = Z_NULL;
+	strm.zfree = Z_NULL;
+	strm.opaque = Z_NULL;
+	/* Each job sets its own parameters */
+	ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8,
+		Z_DEFAULT_STRATEGY);
+
+	pthread_mutex_lock(&pd->lock);
+	for (;;) {
+		while (pd->taken == pd->dispatched && !pd->quit)
+			pthread_cond_wait(&pd->cond, &pd->lock);
+		if (pd->taken == pd->dispatched)
+			break;
+		j = pd_job_at(pd, pd->taken++);
+		pthread_mutex_unlock(&pd->lock);
+
+		done = ret == Z_OK ? pd_compress(&strm, j) : -ENOMEM;
+
+		pthread_mutex_lock(&pd->lock);
+		j->done = done;
+		pthread_cond_broadcast(&pd->cond);
+	}
+	pthread_mutex_unlock(&pd->lock);
+
+	if (ret == Z_OK)
+		deflateEnd(&strm);
+	return NULL;
+}
+
+/* Wait for the oldest job and append its output */
+static int pd_collect(struct pdeflate *pd) {
+	struct pd_job *j = pd_job_at(pd, pd->collected);
+	int ret;
+
+	pthread_mutex_lock(&pd->lock);
+	while (!j->done)
+		pthread_cond_wait(&pd->cond, &pd->lock);
+	pthread_mutex_unlock(&pd->lock);
+
+	ret = j->done;
+	pd->collected++;
+	if (ret < 0)
+		return ret;
+
+	if (ret = pd->emit(j->out, j->out_len))
+		return ret;
+	pd->dst_len += j->out_len;
+	pd->crc = crc32_combine(pd->crc, j->crc, j->len);
+	pd->isize += j->len;
+	return 0;
+}
+
+/* Hand the current job to the workers and set up the next one, primed with
+ * the tail of the input so far.
+ */
+static int pd_dispatch(struct pdeflate *pd, int last) {
+	struct pd_job *j = pd_job_at(pd, pd->dispatched), *n;
+	unsigned long tail;
+	int ret;
+
+	j->last = last;
+	j->done = 0;
+	pthread_mutex_lock(&pd->lock);
+	pd->dispatched++;
+	pthread_cond_broadcast(&pd->cond);
+	pthread_mutex_unlock(&pd->lock);
+
+	if (last)
+		return 0;
+
+	if (pd->dispatched - pd->collected == pd->njobs &&
+		(ret = pd_collect(pd)))
+		return ret;
+
+	n = pd_job_at(pd, pd->dispatched);
+	tail = j->dict + j->len;
+	if (tail > PD_DICT_SZ)
+		tail = PD_DICT_SZ;
+	memcpy(n->buf + PD_DICT_SZ - tail,
+		j->buf + PD_DICT_SZ + j->len - tail, tail);
+	n->dict = tail;
+	n->len = 0;
+	n->segs[0].off = 0;
+	n->segs[0].level = pd->level;
+	n->segs[0].strategy = pd->strategy;
+	n->nsegs = 1;
+	return 0;
+}
+
+static void pd_free(struct pdeflate *pd) {
+	int i;
+
+	pthread_mutex_lock(&pd->lock);
+	pd->quit = 1;
+	pthread_cond_broadcast(&pd->cond);
+	pthread_mutex_unlock(&pd->lock);
+	for (i = 0; i < pd->nthreads; i++)
+		pthread_join(pd->threads[i], NULL);
+
+	for (i = 0; i < pd->njobs; i++)
+		free(pd->jobs[i].buf);
+	free(pd->jobs);
+	pthread_cond_destroy(&pd->cond);
+	pthread_mutex_destroy(&pd->lock);
+	free(pd);
+}
+
+/* pdeflate_init:
+ * Start one worker per configured CPU, handing the gzip stream to emit in
+ * order as blocks complete.
+ */
+struct pdeflate *pdeflate_init(int level,
+		int (*emit)(const char *buf, unsigned long len)) {
+	static const unsigned char gzip_hdr[10] = { 0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3 };
+	struct pdeflate *pd;
+	unsigned long jsz;
+	long ncpu;
+	int i;
+
+	if (!(pd = calloc(1, sizeof(struct pdeflate))))
+		return NULL;
+	pthread_mutex_init(&pd->lock, NULL);
+	pthread_cond_init(&pd->cond, NULL);
+
+	ncpu = sysconf(_SC_NPROCESSORS_CONF);
+	if (ncpu < 1)
+		ncpu = 1;
+	if (ncpu > PD_MAX_THREADS)
+		ncpu = PD_MAX_THREADS;
+	/* Enough jobs to keep every worker busy while we collect */
+	pd->njobs = ncpu * 2;
+	pd->level = level;
+	pd->strategy = Z_DEFAULT_STRATEGY;
+
+	/* Sync-flushed output can slightly exceed the input */
+	jsz = PD_DICT_SZ + PD_BLOCK_SZ + PD_BLOCK_SZ + PD_BLOCK_SZ / 8 + 64;
+	if (!(pd->jobs = calloc(pd->njobs, sizeof(struct pd_job))))
+		goto fail;
+	for (i = 0; i < pd->njobs; i++) {
+		if (!(pd->jobs[i].buf = malloc(jsz)))
+			goto fail;
+		pd->jobs[i].out = pd->jobs[i].buf + PD_DICT_SZ + PD_BLOCK_SZ;
+	}
+	pd->jobs[0].segs[0].level = level;
+	pd->jobs[0].segs[0].strategy = pd->strategy;
+	pd->jobs[0].nsegs = 1;
+
+	for (; pd->nthreads < ncpu; pd->nthreads++)
+		if (pthread_create(&pd->threads[pd->nthreads], NULL,
+			pd_worker, pd))
+			break;
+	if (!pd->nthreads)
+		goto fail;
+
+	pd->emit = emit;
+	if (emit((const char *)gzip_hdr, sizeof(gzip_hdr)))
+		goto fail;
+	pd->dst_len = sizeof(gzip_hdr);
+	pd->crc = crc32(0, Z_NULL, 0);
+	return pd;
+
+fail:
+	if (!pd->jobs)
+		pd->njobs = 0;
+	pd_free(pd);
+	return NULL;
+}
+
+/* pdeflate_params:
+ * Compress whatever's written from here on with a new level and strategy.  A
+ * job that runs out of segments just takes the change at its end.
+ */
+void pdeflate_params(struct pdeflate *pd, int level, int strategy) {
+	struct pd_job *j = pd_job_at(pd, pd->dispatched);
+	struct pd_seg *s = &j->segs[j->nsegs - 1];
+
+	if (level == pd->level && strategy == pd->strategy)
+		return;
+	pd->level = level;
+	pd->strategy = strategy;
+
+	if (s->off != j->len) {
+		if (j->nsegs == PD_MAX_SEGS)
+			return;
+		s = &j->segs[j->nsegs++];
+		s->off = j->len;
+	}
+	s->level = level;
+	s->strategy = strategy;
+}
+
+/* pdeflate_write:
+ * Buffer len bytes, handing off each full block.
+ */
+int pdeflate_write(struct pdeflate *pd, const char *buf, unsigned long len) {
+	struct pd_job *j;
+	unsigned long cnt;
+	int ret;
+
+	while (len) {
+		j = pd_job_at(pd, pd->dispatched);
+		cnt = PD_BLOCK_SZ - j->len;
+		if (cnt > len)
+			cnt = len;
+		memcpy(j->buf + PD_DICT_SZ + j->len, buf, cnt);
+		j->len += cnt;
+		buf += cnt;
+		len -= cnt;
+		if (j->len == PD_BLOCK_SZ && (ret = pd_dispatch(pd, 0)))
+			return ret;
+	}
+	return 0;
+}
+
+/* pdeflate_progress:
+ * Input collected so far, and the compressed size it came to.  Blocks still
+ * with the workers aren't counted.
+ */
+void pdeflate_progress(struct pdeflate *pd, unsigned long *in,
+		unsigned long *out) {
+	*in = pd->isize;
+	*out = pd->dst_len;
+}
+
+/* pdeflate_finish:
+ * Flush the final block, collect everything, write the gzip trailer and tear
+ * down the workers.  Returns the total compressed size, or -errno.
+ */
+long pdeflate_finish(struct pdeflate *pd) {
+	char trailer[8];
+	long ret = 0;
+	int i;
+
+	pd_dispatch(pd, 1);
+	while (pd->collected != pd->dispatched) {
+		i = pd_collect(pd);
+		if (!ret)
+			ret = i;
+	}
+
+	if (!ret) {
+		for (i = 0; i < 4; i++) {
+			trailer[i] = pd->crc >> (8 * i);
+			trailer[i + 4] = pd->isize >> (8 * i);
+		}
+		if (!(ret = pd->emit(trailer, sizeof(trailer))))
+			ret = pd->dst_len + sizeof(trailer);
+	}
+
+	pd_free(pd);
+	return ret;
+}
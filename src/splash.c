@@ -1,3 +1,5 @@
+#include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
@@ -8,48 +10,230 @@
 #include <sys/stat.h>
 
 #include "common.h"
+#include "cpio.h"
 #include <sfpng/src/sfpng.h>
-#include <zlib/contrib/minizip/unzip.h>
+#include <zlib/zlib.h>
 
 #include <stdio.h>
 
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define RLE_NEON
+#define RLE_SIMD
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define RLE_SSE2
+#define RLE_SIMD
+#endif
+
+/* Screen geometry:
+ * Read from the framebuffer's current mode at startup; SCREENX/SCREENY are
+ * only the fallback.
+ */
 #define SCREENX (720)
 #define SCREENY (1280)
-#define INITLOGO_SIZE (4*SCREENX*SCREENY)
+#define SCREEN_MAX (4096)
+#define FBMODES "/sys/class/graphics/fb0/modes"
+static unsigned int screen_x = SCREENX, screen_y = SCREENY;
+#define INITLOGO_SIZE (4*screen_x*screen_y)
 
 #define to565(r,g,b) ((((r) >> 3) << 11) | (((g) >> 2) << 5) | ((b) >> 3))
+
+/* Row kernels:
+ * With NEON, or SSE2 on host builds, a row is packed to 565 in one pass, then
+ * cut into runs by searching for the first pixel that differs from the
+ * current color.  NEON packs 16 pixels at a time, SSE2 8; both compare 8 at a
+ * time when looking for the end of a run.  Scalar loops finish off the ends of
+ * rows.  Without either, the two passes are slower than doing it a pixel at a
+ * time, so rle_compress_row does that instead.
+ *
+ * rle_pack565 may work in place: dst is never ahead of src, and each step
+ * loads its pixels before storing.
+ */
+#ifdef RLE_SIMD
+static void rle_pack565(const uint8_t *src, uint16_t *dst, int n) {
+	int i = 0;
+#ifdef RLE_NEON
+	uint8x16x4_t px;
+	uint16x8_t lo, hi;
+
+	for (; i + 16 <= n; i += 16) {
+		px = vld4q_u8(src + i * 4);
+		/* r << 8, then shift-insert g and b below the bits kept */
+		lo = vshll_n_u8(vget_low_u8(px.val[0]), 8);
+		hi = vshll_n_u8(vget_high_u8(px.val[0]), 8);
+		lo = vsriq_n_u16(lo, vshll_n_u8(vget_low_u8(px.val[1]), 8), 5);
+		hi = vsriq_n_u16(hi, vshll_n_u8(vget_high_u8(px.val[1]), 8), 5);
+		lo = vsriq_n_u16(lo, vshll_n_u8(vget_low_u8(px.val[2]), 8), 11);
+		hi = vsriq_n_u16(hi, vshll_n_u8(vget_high_u8(px.val[2]), 8), 11);
+		vst1q_u16(dst + i, lo);
+		vst1q_u16(dst + i + 8, hi);
+	}
+#else
+	const __m128i rm = _mm_set1_epi32(0xf8), gm = _mm_set1_epi32(0xfc00),
+		bm = _mm_set1_epi32(0xf80000);
+	__m128i a, b;
+
+	for (; i + 8 <= n; i += 8) {
+		a = _mm_loadu_si128((const __m128i *)(src + i * 4));
+		b = _mm_loadu_si128((const __m128i *)(src + i * 4 + 16));
+		a = _mm_or_si128(_mm_or_si128(
+			_mm_slli_epi32(_mm_and_si128(a, rm), 8),
+			_mm_srli_epi32(_mm_and_si128(a, gm), 5)),
+			_mm_srli_epi32(_mm_and_si128(a, bm), 19));
+		b = _mm_or_si128(_mm_or_si128(
+			_mm_slli_epi32(_mm_and_si128(b, rm), 8),
+			_mm_srli_epi32(_mm_and_si128(b, gm), 5)),
+			_mm_srli_epi32(_mm_and_si128(b, bm), 19));
+		/* Sign-extend, so the saturating pack leaves them alone */
+		a = _mm_srai_epi32(_mm_slli_epi32(a, 16), 16);
+		b = _mm_srai_epi32(_mm_slli_epi32(b, 16), 16);
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_packs_epi32(a, b));
+	}
+#endif
+	for (; i < n; i++)
+		dst[i] = to565(src[i * 4], src[i * 4 + 1], src[i * 4 + 2]);
+}
+
+/* How many of the first n pixels are color? */
+static int rle_run(const uint16_t *px, int n, uint16_t color) {
+	int i = 0;
+
+	/* Busy areas are mostly short runs; check those before going wide */
+	for (; i < n && i < 8; i++)
+		if (px[i] != color)
+			return i;
+#ifdef RLE_NEON
+	const uint16x8_t c = vdupq_n_u16(color);
+	uint64_t ne;
+
+	for (; i + 8 <= n; i += 8) {
+		ne = ~vget_lane_u64(vreinterpret_u64_u8(
+			vmovn_u16(vceqq_u16(vld1q_u16(px + i), c))), 0);
+		if (ne)
+			return i + __builtin_ctzll(ne) / 8;
+	}
+#else
+	const __m128i c = _mm_set1_epi16(color);
+	unsigned int ne;
+
+	for (; i + 8 <= n; i += 8) {
+		ne = ~_mm_movemask_epi8(_mm_cmpeq_epi16(
+			_mm_loadu_si128((const __m128i *)(px + i)), c)) & 0xffff;
+		if (ne)
+			return i + __builtin_ctz(ne) / 2;
+	}
+#endif
+	for (; i < n && px[i] == color; i++)
+		;
+	return i;
+}
+#endif
 struct rle_block {
 	unsigned short count, color;
 };
+#define min(a,b) (a<b?a:b)
+
+/* RLE output:
+ * Blocks go into a chain of file_chunks that starts small and doubles, so a
+ * typical logo takes a few KB rather than a worst-case INITLOGO_SIZE buffer.
+ * The chain is handed to the ramdisk as is.  SPLASH_FLATBUF goes back to one
+ * worst-case buffer up front, for comparison.
+ */
+#ifdef SPLASH_FLATBUF
+#define RLE_CHUNK_MIN (INITLOGO_SIZE / sizeof(struct rle_block))
+#else
+#define RLE_CHUNK_MIN (1024) /* blocks */
+#endif
+#define RLE_CHUNK_MAX (64*1024)
 
 struct rle_state {
+	/* The current chunk's blocks; the chain is head..tail */
 	struct rle_block *blocks;
+	struct file_chunk *head, *tail;
 	unsigned char *linebuf;
-	int blocknr;
+	int blocknr, blockmax, err;
 	unsigned short x, y;
-	/* Crop/pad? */
-	/* Number to skip/pad before and after */
-	unsigned short cropx, mincol, maxcol;
-	/* Minimum and maximum row num or num to pad */
-	unsigned short cropy, minrow, maxrow;
+	/* Number of columns/rows to pad before and after */
+	unsigned short mincol, maxcol;
+	unsigned short minrow, maxrow;
+	/* Scaled size, or 0 if not scaling; see rle_scale_row */
+	unsigned short ow, oh, orow;
+	uint16_t *hrow;
+	uint32_t *acc;
+	uint64_t xrecip, yrecip;
+	/* For the cache; see splash_display_text */
+	char author[32];
 };
+static struct file_chunk *rle_chunk_alloc(unsigned int blocks) {
+	struct file_chunk *c;
+
+	if (!(c = malloc(sizeof(*c) + blocks * sizeof(struct rle_block))))
+		return NULL;
+	c->buf = (char *)&c[1];
+	c->len = 0;
+	c->next = NULL;
+	return c;
+}
 static int rle_compress_init(struct rle_state *st) {
-	if (!(st->blocks = malloc(INITLOGO_SIZE))) return -ENOMEM;
+	if (!(st->head = st->tail = rle_chunk_alloc(RLE_CHUNK_MIN)))
+		return -ENOMEM;
+	st->blocks = (struct rle_block *)st->head->buf;
 	st->blocknr = 0;
+	st->blockmax = RLE_CHUNK_MIN;
+	st->err = 0;
 	st->blocks[0].count = 0;
+	st->blocks[0].color = 0;
+	st->linebuf = NULL;
+	st->hrow = NULL;
+	st->acc = NULL;
+	st->ow = 0;
 	return 0;
 }
+static void rle_compress_free(struct rle_state *st) {
+	struct file_chunk *c;
+
+	free(st->linebuf);
+	free(st->hrow);
+	free(st->acc);
+
+	while (c = st->head) {
+		st->head = c->next;
+		free(c);
+	}
+}
+/* The current chunk is full; chain on one twice the size.  If that fails, the
+ * last block is reused, and st->err fails the conversion at the end.
+ */
+static void rle_compress_grow(struct rle_state *st) {
+	struct file_chunk *c;
+	int n = min(st->blockmax * 2, RLE_CHUNK_MAX);
+
+	if (!(c = rle_chunk_alloc(n))) {
+		st->err = -ENOMEM;
+		st->blocknr--;
+		return;
+	}
+	st->tail->len = st->blockmax * sizeof(struct rle_block);
+	st->tail->next = c;
+	st->tail = c;
+	st->blocks = (struct rle_block *)c->buf;
+	st->blocknr = 0;
+	st->blockmax = n;
+}
 static struct rle_block *rle_compress_next_block(struct rle_state *st,
 		unsigned short color) {
 	struct rle_block *bl;
 	bl = &st->blocks[st->blocknr];
-	if (bl->count)
-		bl = &st->blocks[++st->blocknr];
+	if (bl->count) {
+		if (++st->blocknr == st->blockmax)
+			rle_compress_grow(st);
+		bl = &st->blocks[st->blocknr];
+	}
 	bl->count = 0;
 	bl->color = color;
 	return bl;
 }
-#define min(a,b) (a<b?a:b)
 static void rle_compress_pad(struct rle_state *st, int x, int y) {
 	int num = 0, sub;
 	struct rle_block *bl;
@@ -60,32 +244,40 @@ static void rle_compress_pad(struct rle_state *st, int x, int y) {
 		bl = rle_compress_next_block(st, 0);
 	else
 		num = bl->count;
-	for (num += x + (y * SCREENX); num; num -= sub) {
+	for (num += x + (y * screen_x); num; num -= sub) {
 		sub = min(num, 65535);
 		bl->count = sub;
 		bl = rle_compress_next_block(st, 0);
 	}
 }
-static void rle_compress_row(sfpng_decoder *dec, int row, const uint8_t* buf,
-		int len) {
-	struct rle_state *st;
+/* rle_compress_pixels:
+ * Encode one row of len RGBA pixels from linebuf, centered on the screen.
+ */
+static void rle_compress_pixels(struct rle_state *st, int len) {
 	struct rle_block *bl;
+	const uint8_t *buf = st->linebuf;
+#ifdef RLE_SIMD
+	uint16_t *px;
+	int run;
+#else
 	unsigned short color;
+#endif
 
-	st = sfpng_decoder_get_context(dec);
-	if (st->cropy && (row < st->minrow || row > st->maxrow)) return;
-
-	sfpng_decoder_transform(dec, 0, buf, st->linebuf);
-	buf = st->linebuf;
-
-	// Point the buffer to the right columns
-	if (st->cropx) {
-		len = SCREENX;
-		buf = buf + st->mincol * 4;
-	} else {
-		len = st->x;
-		rle_compress_pad(st, st->mincol, 0);
+	rle_compress_pad(st, st->mincol, 0);
+#ifdef RLE_SIMD
+	/* Packed in place, over the start of linebuf */
+	px = (uint16_t *)st->linebuf;
+	rle_pack565(buf, px, len);
+	bl = &st->blocks[st->blocknr];
+	while (len) {
+		if (*px != bl->color || bl->count == 65535)
+			bl = rle_compress_next_block(st, *px);
+		run = rle_run(px, min(len, 65535 - bl->count), bl->color);
+		bl->count += run;
+		px += run;
+		len -= run;
 	}
+#else
 	bl = &st->blocks[st->blocknr];
 	while (len--) {
 		color = to565(buf[0], buf[1], buf[2]);
@@ -94,46 +286,192 @@ static void rle_compress_row(sfpng_decoder *dec, int row, const uint8_t* buf,
 		bl->count++;
 		buf += 4;
 	}
-	if (!st->cropx)
-		rle_compress_pad(st, st->maxcol, 0);
+#endif
+	rle_compress_pad(st, st->maxcol, 0);
+}
+
+/* Scaling:
+ * A PNG bigger than the screen is shrunk to fit, keeping its aspect ratio,
+ * by area averaging in fixed point.  In units of 1/(x*ow), source pixel i
+ * covers [i*ow, (i+1)*ow) and output pixel k covers [k*x, (k+1)*x); every
+ * source pixel is weighted by how much of each output pixel it covers, which
+ * is never more than two.  Rows work the same way, with y and oh.
+ *
+ * Each source row is shrunk horizontally into hrow (8.8 RGB) as it's decoded,
+ * then added into acc with its weight; once an output row is covered, acc is
+ * normalized into linebuf and encoded.  No source rows are kept.
+ */
+static void rle_scale_x(const uint8_t *src, uint16_t *dst, int x, int ow,
+		uint64_t recip) {
+	uint32_t r = 0, g = 0, b = 0, w;
+	int i, s, bound = x;
+
+	for (i = 0, s = 0; i < x; i++, s += ow, src += 4) {
+		if (s + ow < bound) {
+			r += ow * src[0];
+			g += ow * src[1];
+			b += ow * src[2];
+			continue;
+		}
+		w = bound - s;
+		*dst++ = (r + w * src[0]) * recip >> 32;
+		*dst++ = (g + w * src[1]) * recip >> 32;
+		*dst++ = (b + w * src[2]) * recip >> 32;
+		bound += x;
+		w = ow - w;
+		r = w * src[0];
+		g = w * src[1];
+		b = w * src[2];
+	}
+}
+
+/* acc[i] += w * src[i] */
+static void rle_scale_acc(uint32_t *acc, const uint16_t *src, int n,
+		uint16_t w) {
+	int i = 0;
+#if defined(RLE_NEON)
+	uint16x8_t v;
+
+	for (; i + 8 <= n; i += 8) {
+		v = vld1q_u16(src + i);
+		vst1q_u32(acc + i, vmlal_n_u16(vld1q_u32(acc + i),
+			vget_low_u16(v), w));
+		vst1q_u32(acc + i + 4, vmlal_n_u16(vld1q_u32(acc + i + 4),
+			vget_high_u16(v), w));
+	}
+#elif defined(RLE_SSE2)
+	const __m128i wv = _mm_set1_epi16(w);
+	__m128i v, lo, hi;
+
+	for (; i + 8 <= n; i += 8) {
+		v = _mm_loadu_si128((const __m128i *)(src + i));
+		lo = _mm_mullo_epi16(v, wv);
+		hi = _mm_mulhi_epu16(v, wv);
+		_mm_storeu_si128((__m128i *)(acc + i), _mm_add_epi32(
+			_mm_loadu_si128((const __m128i *)(acc + i)),
+			_mm_unpacklo_epi16(lo, hi)));
+		_mm_storeu_si128((__m128i *)(acc + i + 4), _mm_add_epi32(
+			_mm_loadu_si128((const __m128i *)(acc + i + 4)),
+			_mm_unpackhi_epi16(lo, hi)));
+	}
+#endif
+	for (; i < n; i++)
+		acc[i] += w * src[i];
+}
+
+static void rle_scale_emit(struct rle_state *st) {
+	uint8_t *p = st->linebuf;
+	uint32_t *a = st->acc;
+	uint64_t v, half = (uint64_t)1 << 39;
+	int i;
+
+	for (i = 0; i < st->ow; i++, p += 4) {
+		v = (*a++ * st->yrecip + half) >> 40;
+		p[0] = v > 255 ? 255 : v;
+		v = (*a++ * st->yrecip + half) >> 40;
+		p[1] = v > 255 ? 255 : v;
+		v = (*a++ * st->yrecip + half) >> 40;
+		p[2] = v > 255 ? 255 : v;
+	}
+	rle_compress_pixels(st, st->ow);
+	memset(st->acc, 0, 3 * st->ow * sizeof(*st->acc));
+	st->orow++;
+}
+
+static void rle_scale_row(struct rle_state *st, int row) {
+	uint32_t s = row * st->oh, bound = (st->orow + 1) * st->y, w;
+
+	rle_scale_x(st->linebuf, st->hrow, st->x, st->ow, st->xrecip);
+	if (s + st->oh < bound) {
+		rle_scale_acc(st->acc, st->hrow, 3 * st->ow, st->oh);
+		return;
+	}
+	w = bound - s;
+	rle_scale_acc(st->acc, st->hrow, 3 * st->ow, w);
+	rle_scale_emit(st);
+	if (w < st->oh)
+		rle_scale_acc(st->acc, st->hrow, 3 * st->ow, st->oh - w);
+}
+
+static void rle_compress_row(sfpng_decoder *dec, int row, const uint8_t* buf,
+		int len) {
+	struct rle_state *st = sfpng_decoder_get_context(dec);
+
+	if (st->err || !st->linebuf)
+		return;
+	sfpng_decoder_transform(dec, 0, buf, st->linebuf);
+	if (st->ow)
+		rle_scale_row(st, row);
+	else
+		rle_compress_pixels(st, st->x);
 }
 static void rle_compress_prepare(sfpng_decoder *dec) {
 	struct rle_state *st;
-	int x, y;
+	unsigned int x, y, ow, oh;
 
 	st = sfpng_decoder_get_context(dec);
 	x = sfpng_decoder_get_width(dec);
-	// Sure would be nice to check this.
-	st->linebuf = malloc(4 * x);
-	if (x < SCREENX) {
-		st->cropx = 0;
-		st->mincol = (SCREENX - x) / 2;
-		st->maxcol = SCREENX - x - st->mincol;
-	} else if (x > SCREENX) {
-		st->cropx = 1;
-		st->mincol = (x - SCREENX) / 2;
-		st->maxcol = x - SCREENX - st->mincol;
-	} else {
-		st->cropx = 1;
-		st->mincol = st->maxcol = 0;
-	}
 	y = sfpng_decoder_get_height(dec);
-	if (y < SCREENY) {
-		st->cropy = 0;
-		st->minrow = (SCREENY - y) / 2;
-		st->maxrow = SCREENY - y - st->minrow;
-	} else if (y > SCREENY) {
-		st->cropy = 1;
-		st->minrow = (y - SCREENY) / 2;
-		st->maxrow = SCREENY + st->minrow - 1;
-	} else {
-		st->cropy = 1;
-		st->minrow = 0;
-		st->maxrow = 1279;
+	if (!x || !y || x > 16384 || y > 16384) {
+		st->err = -EINVAL;
+		return;
+	}
+	if (!(st->linebuf = malloc(4 * x))) {
+		st->err = -ENOMEM;
+		return;
+	}
+	ow = x;
+	oh = y;
+	if (x > screen_x || y > screen_y) {
+		/* Fit the tighter dimension to the screen */
+		if ((uint64_t)x * screen_y > (uint64_t)y * screen_x) {
+			ow = screen_x;
+			oh = ((uint64_t)y * screen_x + x / 2) / x;
+		} else {
+			oh = screen_y;
+			ow = ((uint64_t)x * screen_y + y / 2) / y;
+		}
+		ow = ow ? ow : 1;
+		oh = oh ? oh : 1;
+		st->hrow = malloc(3 * ow * sizeof(*st->hrow));
+		st->acc = calloc(3 * ow, sizeof(*st->acc));
+		if (!st->hrow || !st->acc) {
+			st->err = -ENOMEM;
+			return;
+		}
+		st->ow = ow;
+		st->oh = oh;
+		st->orow = 0;
+		/* Source pixels to 8.8, then output rows back to 8 bits;
+		 * rounded up, so a flat color comes out unchanged
+		 */
+		st->xrecip = (((uint64_t)256 << 32) + x - 1) / x;
+		st->yrecip = (((uint64_t)1 << 40) + y * 256 - 1) / (y * 256);
 	}
+	st->mincol = (screen_x - ow) / 2;
+	st->maxcol = screen_x - ow - st->mincol;
+	st->minrow = (screen_y - oh) / 2;
+	st->maxrow = screen_y - oh - st->minrow;
 	st->x = x;
 	st->y = y;
-	rle_compress_pad(st, 0, st->cropy ? 0 : st->minrow);
+	rle_compress_pad(st, 0, st->minrow);
+}
+
+/* splash_geometry:
+ * fb0's modes file reads like "U:720x1280p-60".
+ */
+static void splash_geometry(void) {
+	unsigned int x, y;
+	FILE *f;
+
+	if (!(f = fopen(FBMODES, "r")))
+		return;
+	if (fscanf(f, "%*c:%ux%u", &x, &y) == 2 && x && y &&
+		x <= SCREEN_MAX && y <= SCREEN_MAX) {
+		screen_x = x;
+		screen_y = y;
+	}
+	fclose(f);
 }
 
 static inline int should_skip_splash(void) {
@@ -160,7 +498,7 @@ static int try_userrle(void) {
 	return ramdisk_push_override("initlogo.rle", buf, sz);
 }
 static int try_userpng(sfpng_decoder *dec, char *buf) {
-	int fd, rd;
+	int fd, rd, ret = 0;
 	sfpng_status stat;
 
 	fd = open(USERPNG, O_RDONLY);
@@ -168,18 +506,112 @@ static int try_userpng(sfpng_decoder *dec, char *buf) {
 	do {
 		rd = read(fd, buf, CHUNK_SIZE);
 		if (rd < 0) {
+			ret = -4;
 			rprint("Reading PNG failed!");
 			break;
 		}
 		stat = sfpng_decoder_write(dec, buf, rd);
 		if (stat != SFPNG_SUCCESS) {
+			ret = -4;
 			rprint("PNG is invalid!");
 			break;
 		}
 	} while (rd > 0);
+	close(fd);
+	return ret;
+}
+
+/* Splash cache:
+ * The last conversion is kept in SPLASHCACHE, behind a header saying what it
+ * was made from: the CRC and size of the PNG, and the screen geometry.  If
+ * those match, the PNG isn't decoded at all.  The author is kept too, so it
+ * can still be shown.  A zipped PNG's key comes straight from the zip's
+ * central directory; the user's has to be read once to CRC it.
+ */
+#define SPLASH_CACHE_MAGIC "DKPRLE1"
+struct splash_cache {
+	/* The key; compared as a whole */
+	char magic[8];
+	uint32_t crc, size;
+	uint16_t x, y;
+	/* The rest */
+	uint32_t len; /* of the initlogo.rle that follows */
+	char author[32];
+};
+#define SPLASH_KEY_LEN offsetof(struct splash_cache, len)
+
+static int splash_key_file(const char *path, struct splash_cache *key,
+		char *buf) {
+	unsigned long crc = crc32(0, Z_NULL, 0), size = 0;
+	int fd, rd;
+
+	if ((fd = open(path, O_RDONLY)) == -1)
+		return -ENOENT;
+	while ((rd = read(fd, buf, CHUNK_SIZE)) > 0) {
+		crc = crc32(crc, (const unsigned char *)buf, rd);
+		size += rd;
+	}
+	close(fd);
+	if (rd < 0)
+		return -EIO;
+	key->crc = crc;
+	key->size = size;
 	return 0;
 }
 
+static int splash_cache_get(const struct splash_cache *key) {
+	struct splash_cache hdr;
+	char *buf;
+	char print[80] = "ui_print Using a splash screen from ";
+	int fd, ret = -ENOENT;
+
+	if ((fd = open(SPLASHCACHE, O_RDONLY)) == -1)
+		return -ENOENT;
+	if (read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+		memcmp(&hdr, key, SPLASH_KEY_LEN) || hdr.len > INITLOGO_SIZE)
+		goto out;
+	if (!(buf = malloc(hdr.len ? hdr.len : 1))) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	if (read(fd, buf, hdr.len) != hdr.len) {
+		free(buf);
+		goto out;
+	}
+	hdr.author[sizeof(hdr.author) - 1] = 0;
+	if (hdr.author[0]) {
+		strcat(print, hdr.author);
+		strcat(print, "\nui_print\n");
+		iwrite(cmdfd, print);
+	}
+	if (ret = ramdisk_push_override("initlogo.rle", buf, hdr.len))
+		free(buf);
+out:
+	close(fd);
+	return ret;
+}
+
+/* Written to a temporary file first, so a half-written cache is never read */
+static void splash_cache_put(struct splash_cache *key, const char *author,
+		const struct file_chunk *chunks) {
+	const struct file_chunk *c;
+	int fd, ok;
+
+	for (key->len = 0, c = chunks; c; c = c->next)
+		key->len += c->len;
+	snprintf(key->author, sizeof(key->author), "%s", author);
+	if ((fd = open(SPLASHCACHE ".tmp", O_WRONLY | O_CREAT | O_TRUNC,
+		0644)) == -1)
+		return;
+	ok = write(fd, key, sizeof(*key)) == sizeof(*key);
+	for (c = chunks; ok && c; c = c->next)
+		ok = write(fd, c->buf, c->len) == c->len;
+	if (close(fd) || !ok)
+		unlink(SPLASHCACHE ".tmp");
+	else
+		rename(SPLASHCACHE ".tmp", SPLASHCACHE);
+}
+
 #ifdef ZIPFMT
 static char random_zip_name[] = ZIPFMT;
 static void randomize_zipsplash(void) {
@@ -202,40 +634,33 @@ static inline void randomize_zipsplash(void) { }
 
 static void splash_display_text(sfpng_decoder *dec,
 		const char *keyword, const uint8_t *text, int len) {
+	struct rle_state *st = sfpng_decoder_get_context(dec);
 	char print[80] = "ui_print Using a splash screen from ";
 	if (strncmp((const char *)keyword, "Author", 12))
 		return;
 	if (len > 30) len = 30;
+	memcpy(st->author, text, len);
+	st->author[len] = 0;
 	strncat(print, (const char *)text, len);
 	strcat(print, "\nui_print\n");
 	iwrite(cmdfd, print);
 }
 
-static int try_zippng(sfpng_decoder *dec, char *buf) {
+static int try_zippng(sfpng_decoder *dec, char *buf,
+		const struct zip_entry *ze) {
 	int ret = 0;
-	int rd;
-	unzFile zip;
+	long rd;
+	struct zip_file *zf;
 	sfpng_status stat;
 
-	if (!(zip = unzOpen(zip_path))) {
-		ret = -ENOENT;
-		rprint("Can't open zip!");
-		goto out;
-	}
-	randomize_zipsplash();
-	if (unzLocateFile(zip, random_zip_name, 1) != UNZ_OK) {
-		ret = -ENOENT;
-		//rprint("Can't find PNG in zip!");
-		goto out_close;
-	}
-	if (unzOpenCurrentFile(zip) != UNZ_OK) {
+	if (!(zf = zip_fopen(ze))) {
 		ret = -EBADF;
 		rprint("Can't open PNG in zip!");
-		goto out_close;
+		goto out;
 	}
 
 	do {
-		rd = unzReadCurrentFile(zip, buf, CHUNK_SIZE);
+		rd = zip_fread(zf, buf, CHUNK_SIZE);
 		if (rd < 0) {
 			ret = -4;
 			rprint("Reading PNG failed!");
@@ -249,11 +674,9 @@ static int try_zippng(sfpng_decoder *dec, char *buf) {
 		}
 	} while (rd > 0);
 
-	if (unzCloseCurrentFile(zip) == UNZ_CRCERROR)
+	if (zip_fclose(zf) == -EBADMSG)
 		rprint("Corrupt PNG in zip!");
 
-out_close:
-	unzClose(zip);
 out:
 	return ret;
 }
@@ -263,9 +686,11 @@ void *generate_splash(void *arg) {
 #ifdef RECOVERY_BUILD
 	int do_umount = 1;
 #endif
-	int do_data = 1;
+	int do_data = 1, user = 0;
 	char *buf;
 	struct rle_state st;
+	struct splash_cache key;
+	const struct zip_entry *ze = NULL;
 	sfpng_decoder *dec;
 
 #ifdef RECOVERY_BUILD
@@ -278,6 +703,7 @@ void *generate_splash(void *arg) {
 #endif
 
 	if (should_skip_splash()) goto out_umount;
+	splash_geometry();
 
 	if (do_data) {
 		if (!(ret = try_userrle())) goto out_umount;
@@ -287,31 +713,69 @@ void *generate_splash(void *arg) {
 		ret = -ENOMEM;
 		goto out_umount;
 	}
+
+	/* Which PNG, and has it been converted before? */
+	memset(&key, 0, sizeof(key));
+	memcpy(key.magic, SPLASH_CACHE_MAGIC, sizeof(key.magic));
+	key.x = screen_x;
+	key.y = screen_y;
+	if (do_data)
+		user = !splash_key_file(USERPNG, &key, buf);
+	if (!user) {
+		randomize_zipsplash();
+		if (!(ze = zip_find(random_zip_name))) {
+			ret = -ENOENT;
+			//rprint("Can't find PNG in zip!");
+			goto out_buf;
+		}
+		key.crc = ze->crc;
+		key.size = ze->usize;
+	}
+	if (do_data && !(ret = splash_cache_get(&key)))
+		goto out_buf;
+
 	if (ret = rle_compress_init(&st))
-		goto out_umount;
+		goto out_buf;
+	st.author[0] = 0;
 	dec = sfpng_decoder_new();
 	sfpng_decoder_set_context(dec, &st);
 	sfpng_decoder_set_info_func(dec, rle_compress_prepare);
 	sfpng_decoder_set_row_func(dec, rle_compress_row);
 	sfpng_decoder_set_text_func(dec, splash_display_text);
 
-	if (do_data) {
-		if (!(ret = try_userpng(dec, buf))) goto finish_rle;
+	/* A broken user PNG is used as far as it goes, but not cached */
+	if (user) {
+		if ((ret = try_userpng(dec, buf)) == -ENOENT)
+			goto out_free;
+	} else if (ret = try_zippng(dec, buf, ze))
+		goto out_free;
+
+	if (!st.linebuf && !st.err)
+		st.err = -EINVAL;
+	if (st.err) {
+		ret = st.err;
+		rprint("Splash conversion failed!");
+		goto out_free;
 	}
-	if (!(ret = try_zippng(dec, buf))) goto finish_rle;
-	goto out_free;
-
-finish_rle:
-	if (!st.cropy)
-		rle_compress_pad(&st, 0, st.maxrow);
+	rle_compress_pad(&st, 0, st.maxrow);
 	if (st.blocks[st.blocknr].count)
 		st.blocknr++;
+	st.tail->len = st.blocknr * sizeof(struct rle_block);
+	if (st.err) {
+		ret = st.err;
+		rprint("Allocation failed!");
+		goto out_free;
+	}
 	rprint("Converted splash screen");
-	ret = ramdisk_push_override("initlogo.rle", (char *)st.blocks,
-		st.blocknr * sizeof(struct rle_block));
+	if (do_data && !ret)
+		splash_cache_put(&key, st.author, st.head);
+	if (!(ret = ramdisk_push_override_chunks("initlogo.rle", st.head)))
+		st.head = NULL;
 
 out_free:
+	rle_compress_free(&st);
 	sfpng_decoder_free(dec);
+out_buf:
 	free(buf);
 
 out_umount:
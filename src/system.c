@@ -1,107 +1,658 @@
+#define _GNU_SOURCE
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <pthread.h>
 #include <sys/types.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
 #include <linux/fs.h>
 
 #include "common.h"
 #include <zlib/zlib.h>
-#include <zlib/contrib/minizip/unzip.h>
 
-#define CHUNK_SIZE (32*1024)
-void *unpack_system(void *arg) {
-	long ret;
-	unzFile zip;
+/* Deflated files are inflated through a buffer this big, per worker; stored
+ * ones don't need one.
+ */
+#define SYS_BUF_SIZE (256*1024)
+
+/* Extraction pool:
+ * Files are sorted largest-first and dealt round-robin onto per-worker
+ * queues, so every worker starts on a big one.  A worker takes from the front
+ * of its own queue; once that's empty, it steals from the back of the others,
+ * where the small files are.  No work is added after the start, so an empty
+ * sweep means we're done.
+ *
+ * While the ramdisk is being compressed, only SYS_BUSY_WORKERS keep going, so
+ * the boot.img path keeps its CPUs.
+ */
+#define SYS_MAX_WORKERS (4)
+#define SYS_BUSY_WORKERS (1)
+
+struct sys_queue {
+	pthread_mutex_t lock;
+	unsigned int head, tail;
+	const struct zip_entry **ents;
+};
+
+struct sys_worker {
+	struct sys_queue *queues;
+	int id, nworkers;
+	pthread_t thread;
+};
+
+/* Write-back:
+ * Files are pushed to disk as they're extracted, instead of all at once by
+ * umount.  Every SYS_WB_CHUNK written starts write-back of that range, after
+ * waiting on whatever was started before it, which keeps big files from
+ * piling up dirty pages; the rest of a file is started when it's closed.
+ * One syncfs before umount then only waits for what's still in flight.
+ */
+#define SYS_WB_CHUNK (4*1024*1024)
+
+/* Incremental installs:
+ * A file already on /system is left alone if its size and CRC match the zip's
+ * central directory.  With SYSTEM_MANIFEST, what was installed last time is
+ * recorded in SYSMANIFEST as "crc size mtime name" lines; a file whose size
+ * and mtime still match its line, and whose CRC matches the zip, isn't even
+ * re-hashed.  man[] is indexed like the zip, and its mtime is -1 for files
+ * that weren't installed.
+ */
+struct sys_man {
+	unsigned long crc, size;
+	long mtime;
+};
+static struct sys_man *man;
+static struct {
+	unsigned int skipped, written;
+	unsigned long skipped_bytes, written_bytes;
+} sys_stats;
+
+#define sys_man_of(ze) (&man[(ze) - zip_entry_at(0)])
+
+/* Directory tree:
+ * Every directory under system/, listed in the zip or only implied by a
+ * path, is created before extraction starts, parents first, and kept open.
+ * Files are then created relative to their parent's fd, without re-walking
+ * the whole path.  Modes, and symlinks, come from the zip's Unix attributes
+ * where it has them, but only for what this run creates or writes; existing
+ * directories and unchanged files keep theirs.  A file whose directory
+ * couldn't be opened falls back to its full path.
+ */
+#define SYS_DIR_MODE (0755)
+#define SYS_FILE_MODE (0755)
+#define sys_perm(mode, def) ((mode) & 07777 ? (mode) & 07777 : (def))
+
+struct sys_dir {
+	const char *name; /* a prefix of a zip name; not NUL-terminated */
+	unsigned int len, mode;
+	int fd;
+};
+static struct sys_dir *dirs;
+static unsigned int ndirs;
+
+static pthread_mutex_t throttle_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t throttle_cond = PTHREAD_COND_INITIALIZER;
+static int throttled = 0;
+
+/* system_throttle:
+ * Called by generate_ramdisk around compression.
+ */
+void system_throttle(int busy) {
+	pthread_mutex_lock(&throttle_lock);
+	throttled = busy;
+	if (!busy)
+		pthread_cond_broadcast(&throttle_cond);
+	pthread_mutex_unlock(&throttle_lock);
+}
+static void sys_wait_throttle(int id) {
+	if (id < SYS_BUSY_WORKERS)
+		return;
+	pthread_mutex_lock(&throttle_lock);
+	while (throttled)
+		pthread_cond_wait(&throttle_cond, &throttle_lock);
+	pthread_mutex_unlock(&throttle_lock);
+}
+
+static const struct zip_entry *sys_take(struct sys_worker *w) {
+	const struct zip_entry *ze = NULL;
+	struct sys_queue *q;
+	int i;
+
+	for (i = 0; i < w->nworkers && !ze; i++) {
+		q = &w->queues[(w->id + i) % w->nworkers];
+		pthread_mutex_lock(&q->lock);
+		if (q->head != q->tail)
+			ze = i ? q->ents[--q->tail] : q->ents[q->head++];
+		pthread_mutex_unlock(&q->lock);
+	}
+	return ze;
+}
+
+static int sys_dir_cmp(const void *a, const void *b) {
+	const struct sys_dir *x = a, *y = b;
+	int cmp = memcmp(x->name, y->name, x->len < y->len ? x->len : y->len);
+	return cmp ? cmp : (int)x->len - (int)y->len;
+}
+
+static int sys_dir_find(const char *name, unsigned int len) {
+	struct sys_dir key = { name, len }, *d;
+
+	d = bsearch(&key, dirs, ndirs, sizeof(*dirs), sys_dir_cmp);
+	return d ? d - dirs : -1;
+}
+
+/* sys_make_dirs:
+ * Gather every directory prefix of the system/ entries from first on, then
+ * create and open them in sorted order, which puts parents first.
+ */
+static int sys_make_dirs(unsigned int first, unsigned int n) {
+	const struct zip_entry *ze;
+	const char *p;
+	struct sys_dir *d;
+	char base[256];
+	unsigned int i, max = 0, len;
+	int up, pfd, made = 0;
+
+	for (i = first; i < n; i++) {
+		ze = zip_entry_at(i);
+		if (!strncmp(ze->name, "system/", 7))
+			for (p = ze->name; p = strchr(p, '/'); p++)
+				max++;
+	}
+	if (!(dirs = malloc((max ? max : 1) * sizeof(*dirs))))
+		return -ENOMEM;
+	for (i = first; i < n; i++) {
+		ze = zip_entry_at(i);
+		if (strncmp(ze->name, "system/", 7))
+			continue;
+		for (p = ze->name; p = strchr(p, '/'); p++) {
+			d = &dirs[ndirs++];
+			d->name = ze->name;
+			d->len = p - ze->name;
+			/* Only a directory's own entry says what its mode is */
+			d->mode = p[1] ? 0 : ze->mode;
+			d->fd = -1;
+		}
+	}
+	qsort(dirs, ndirs, sizeof(*dirs), sys_dir_cmp);
+	for (i = 1, max = ndirs, ndirs = ndirs ? 1 : 0; i < max; i++) {
+		if (!sys_dir_cmp(&dirs[ndirs - 1], &dirs[i])) {
+			if (!dirs[ndirs - 1].mode)
+				dirs[ndirs - 1].mode = dirs[i].mode;
+		} else {
+			dirs[ndirs++] = dirs[i];
+		}
+	}
+
+	for (i = 0; i < ndirs; i++) {
+		d = &dirs[i];
+		if (p = memrchr(d->name, '/', d->len)) {
+			if ((up = sys_dir_find(d->name, p - d->name)) < 0 ||
+				(pfd = dirs[up].fd) < 0)
+				continue;
+			p++;
+		} else {
+			pfd = AT_FDCWD;
+			p = d->name;
+		}
+		if (!(len = d->name + d->len - p) || len >= sizeof(base))
+			continue;
+		memcpy(base, p, len);
+		base[len] = 0;
 #ifdef RECOVERY_BUILD
-	int do_umount = 1;
-	int rd, wr, fd;
+		made = !mkdirat(pfd, base, sys_perm(d->mode, SYS_DIR_MODE));
+		if (!made && errno != EEXIST)
+			continue;
+#endif
+		d->fd = openat(pfd, base, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		/* The zip's mode only goes on directories we just made */
+		if (made && d->fd >= 0 && d->mode & 07777)
+			fchmod(d->fd, d->mode & 07777);
+	}
+	return 0;
+}
+
+static void sys_close_dirs(void) {
+	unsigned int i;
+
+	for (i = 0; i < ndirs; i++)
+		if (dirs[i].fd >= 0)
+			close(dirs[i].fd);
+	free(dirs);
+	dirs = NULL;
+	ndirs = 0;
+}
+
+/* sys_at:
+ * The fd of ze's directory, and its name relative to that.
+ */
+static int sys_at(const struct zip_entry *ze, const char **base) {
+	const char *p = memrchr(ze->name, '/', ze->namelen);
+	int i = sys_dir_find(ze->name, p - ze->name);
+
+	if (i < 0 || dirs[i].fd < 0) {
+		*base = ze->name;
+		return AT_FDCWD;
+	}
+	*base = p + 1;
+	return dirs[i].fd;
+}
+
+#ifdef RECOVERY_BUILD
+/* Raw syscalls:
+ * android-19 bionic has no fallocate, sync_file_range or syncfs wrappers, so
+ * they're called directly; a kernel without one just doesn't get the hint,
+ * and umount still flushes everything.  32-bit ABIs take each 64-bit
+ * argument as two halves, low first.  ARM's sync_file_range2 moves the
+ * flags up front so the halves stay register-aligned.
+ */
+#if __SIZEOF_LONG__ == 4
+#define SYS_ARG64(x) (long)(x), (long)((unsigned long long)(x) >> 32)
 #else
-	int rd;
+#define SYS_ARG64(x) (long)(x)
+#endif
+
+/* sys_reserve:
+ * fallocate the first len bytes of fd, if the kernel can.
+ */
+static void sys_reserve(int fd, unsigned long len) {
+#ifdef __NR_fallocate
+	syscall(__NR_fallocate, fd, 0, SYS_ARG64(0), SYS_ARG64(len));
+#endif
+}
+
+static void sys_sync_range(int fd, off_t off, off_t len, unsigned int flags) {
+#if defined(__NR_sync_file_range2)
+	syscall(__NR_sync_file_range2, fd, flags, SYS_ARG64(off),
+		SYS_ARG64(len));
+#elif defined(__NR_sync_file_range)
+	syscall(__NR_sync_file_range, fd, SYS_ARG64(off), SYS_ARG64(len),
+		flags);
+#endif
+}
+
+/* sys_writeback:
+ * Start write-back of [*wb, pos) once it's big enough, or at the end.
+ */
+static void sys_writeback(int fd, off_t *wb, off_t pos, int last) {
+	if (pos == *wb || (!last && pos - *wb < SYS_WB_CHUNK))
+		return;
+	if (*wb)
+		sys_sync_range(fd, 0, *wb, SYNC_FILE_RANGE_WAIT_BEFORE);
+	sys_sync_range(fd, *wb, pos - *wb, SYNC_FILE_RANGE_WRITE);
+	*wb = pos;
+}
 #endif
-	char namebuf[256];
-	char *buf = 0;
 
-	if (!(buf = malloc(CHUNK_SIZE))) goto out;
-	if (!(zip = unzOpen(zip_path))) {
-		ret = -ENOENT;
-		rprint("Can't open zip!");
+/* A symlink's target is its contents.  They're cheap, so always redone. */
+static int sys_symlink(const struct zip_entry *ze, int dfd, const char *base) {
+	char *target;
+	int ret;
+
+	if (!(target = malloc(ze->usize + 1)))
+		return -ENOMEM;
+	if (ret = zip_extract(ze, target)) {
+		if (ret != -EBADMSG)
+			ret = -EBADF;
 		goto out;
 	}
-	if (unzGoToFirstFile(zip) != UNZ_OK) {
+	target[ze->usize] = 0;
+#ifdef RECOVERY_BUILD
+	unlinkat(dfd, base, 0);
+	if (symlinkat(target, dfd, base))
 		ret = -EIO;
-		rprint("Zip is corrupt!");
-		goto out_close;
+#else
+	printf("%s: linking %s -> %s\n", __func__, ze->name, target);
+#endif
+out:
+	free(target);
+	return ret;
+}
+
+/* CRC a whole file through a read-only mapping; ~0UL if it can't be read */
+static unsigned long sys_crc_file(int dfd, const char *name,
+		unsigned long size) {
+	unsigned long crc = ~0UL;
+	void *map;
+	int fd;
+
+	if ((fd = openat(dfd, name, O_RDONLY)) < 0)
+		return crc;
+	if (!size) {
+		crc = crc32(0, Z_NULL, 0);
+	} else if ((map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0)) !=
+		MAP_FAILED) {
+		crc = crc32(crc32(0, Z_NULL, 0), map, size);
+		munmap(map, size);
 	}
-	if (unzLocateFile(zip, "system/", 1) != UNZ_OK) {
-		unzClose(zip);
+	close(fd);
+	return crc;
+}
+
+/* Is the file already installed?  st is filled in either way. */
+static int sys_unchanged(const struct zip_entry *ze, int dfd,
+		const char *base, struct stat *st) {
+	struct sys_man *m = sys_man_of(ze);
+
+	if (fstatat(dfd, base, st, 0) || !S_ISREG(st->st_mode) ||
+		st->st_size != ze->usize)
+		return 0;
+	if (m->mtime == st->st_mtime && m->size == ze->usize &&
+		m->crc == ze->crc)
+		return 1;
+	return sys_crc_file(dfd, base, ze->usize) == ze->crc;
+}
+
+static void sys_extract(const struct zip_entry *ze, char *buf) {
+	struct sys_man *m = sys_man_of(ze);
+	struct zip_file *zf;
+	struct stat st;
+	const char *base;
+	long rd;
+	int ret, dfd = sys_at(ze, &base);
+#ifdef RECOVERY_BUILD
+	const char *src;
+	long cnt, wr;
+	off_t pos = 0, wb = 0;
+	int fd;
+#endif
+
+	m->mtime = -1;
+	if (S_ISLNK(ze->mode)) {
+		ret = sys_symlink(ze, dfd, base);
+		goto done;
+	}
+	if (sys_unchanged(ze, dfd, base, &st)) {
+#ifndef RECOVERY_BUILD
+		printf("%s: unchanged %s\n", __func__, ze->name);
+#endif
+		__atomic_add_fetch(&sys_stats.skipped, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&sys_stats.skipped_bytes, ze->usize,
+			__ATOMIC_RELAXED);
+		goto out;
+	}
+
+#ifdef RECOVERY_BUILD
+	/* A stored member's CRC can be checked before the old file is touched */
+	if (ze->method == 0 && (ret = zip_map(ze, &src))) {
+		if (ret == -EINVAL)
+			ret = -EBADF;
+		goto done;
+	}
+	fd = openat(dfd, base, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+		sys_perm(ze->mode, SYS_FILE_MODE));
+	if (fd < 0) {
+		rprint("Unable to create file!");
+		return;
+	}
+	if (ze->mode & 07777)
+		fchmod(fd, ze->mode & 07777);
+	/* Reserve the space up front; failure just means we don't get to */
+	if (ze->usize)
+		sys_reserve(fd, ze->usize);
+	if (ze->method == 0) {
+		/* Stored: straight from the zip's fd to ours */
+		ret = zip_copy(ze, src, fd);
+		pos = ze->usize;
+	} else if (!(zf = zip_fopen(ze))) {
+		ret = -EBADF;
+	} else {
+		do {
+			rd = zip_fread(zf, buf, SYS_BUF_SIZE);
+			for (cnt = rd, wr = 0; cnt > 0; cnt -= wr)
+				if ((wr = write(fd, buf + rd - cnt, cnt)) < 0)
+					break;
+			if (rd > 0 && wr >= 0)
+				sys_writeback(fd, &wb, pos += rd, 0);
+		} while (rd > 0 && wr >= 0);
+		ret = zip_fclose(zf);
+		if (rd < 0 || wr < 0)
+			ret = -EIO;
+	}
+	if (!ret)
+		sys_writeback(fd, &wb, pos, 1);
+	if (close(fd) && !ret)
+		ret = -EIO;
+#else
+	printf("%s: extracting %s\n", __func__, ze->name);
+	if (!(zf = zip_fopen(ze))) {
+		ret = -EBADF;
+	} else {
+		do {
+			rd = zip_fread(zf, buf, SYS_BUF_SIZE);
+		} while (rd > 0);
+		ret = zip_fclose(zf);
+	}
+#endif
+done:
+	if (ret == -EBADF) {
+		rprint("Error opening file in zip!");
+		return;
+	} else if (ret == -EBADMSG) {
+		rprint("CRC error!");
+		return;
+	} else if (ret) {
+		rprint("Error writing file!");
+		return;
+	}
+	__atomic_add_fetch(&sys_stats.written, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&sys_stats.written_bytes, ze->usize,
+		__ATOMIC_RELAXED);
+	if (S_ISLNK(ze->mode) || fstatat(dfd, base, &st, 0))
+		return;
+out:
+	m->crc = ze->crc;
+	m->size = ze->usize;
+	m->mtime = st.st_mtime;
+}
+
+#ifdef SYSTEM_MANIFEST
+static void sys_read_manifest(void) {
+	const struct zip_entry *ze;
+	unsigned long crc, size;
+	long mtime;
+	char *line = NULL;
+	size_t len = 0;
+	ssize_t rd;
+	FILE *f;
+	int pos;
+
+	if (!(f = fopen(SYSMANIFEST, "r")))
+		return;
+	while ((rd = getline(&line, &len, f)) > 0) {
+		if (line[rd - 1] == '\n')
+			line[rd - 1] = 0;
+		if (sscanf(line, "%lx %lu %ld %n", &crc, &size, &mtime,
+			&pos) != 3 || !(ze = zip_find(line + pos)))
+			continue;
+		sys_man_of(ze)->crc = crc;
+		sys_man_of(ze)->size = size;
+		sys_man_of(ze)->mtime = mtime;
+	}
+	free(line);
+	fclose(f);
+}
+
+/* Written to a temporary file first, so a crash can't leave a half-written
+ * manifest that's trusted next time.
+ */
+static void sys_write_manifest(const struct zip_entry **files,
+		unsigned int nfiles) {
+	struct sys_man *m;
+	unsigned int i;
+	FILE *f;
+
+	if (!(f = fopen(SYSMANIFEST ".tmp", "w")))
+		return;
+	for (i = 0; i < nfiles; i++) {
+		m = sys_man_of(files[i]);
+		if (m->mtime != -1)
+			fprintf(f, "%08lx %lu %ld %s\n", m->crc, m->size,
+				m->mtime, files[i]->name);
+	}
+	if (fclose(f))
+		unlink(SYSMANIFEST ".tmp");
+	else
+		rename(SYSMANIFEST ".tmp", SYSMANIFEST);
+}
+#endif
+
+static void *sys_worker(void *arg) {
+	struct sys_worker *w = arg;
+	const struct zip_entry *ze;
+	char *buf;
+
+	if (!(buf = malloc(SYS_BUF_SIZE)))
+		return (void *)-ENOMEM;
+	while (ze = sys_take(w)) {
+		sys_wait_throttle(w->id);
+		sys_extract(ze, buf);
+	}
+	free(buf);
+	return 0;
+}
+
+static void sys_report(void) {
+	char msg[128];
+
+#ifdef RECOVERY_BUILD
+	snprintf(msg, sizeof(msg), "ui_print System: %u files (%lu KB) "
+		"unchanged, %u (%lu KB) written\nui_print\n",
+		sys_stats.skipped, sys_stats.skipped_bytes >> 10,
+		sys_stats.written, sys_stats.written_bytes >> 10);
+	iwrite(cmdfd, msg);
+#else
+	snprintf(msg, sizeof(msg), "%u files (%lu KB) unchanged, "
+		"%u (%lu KB) written", sys_stats.skipped,
+		sys_stats.skipped_bytes >> 10, sys_stats.written,
+		sys_stats.written_bytes >> 10);
+	printf("%s: %s\n", __func__, msg);
+#endif
+}
+
+/* Milliseconds since *t, which is moved up to now */
+static unsigned long sys_lap(struct timespec *t) {
+	struct timespec now;
+	unsigned long ms;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ms = (now.tv_sec - t->tv_sec) * 1000 +
+		(now.tv_nsec - t->tv_nsec) / 1000000;
+	*t = now;
+	return ms;
+}
+
+static int sys_cmp_size(const void *a, const void *b) {
+	const struct zip_entry *x = *(const struct zip_entry **)a;
+	const struct zip_entry *y = *(const struct zip_entry **)b;
+	return x->usize < y->usize ? 1 : x->usize > y->usize ? -1 : 0;
+}
+
+void *unpack_system(void *arg) {
+	long ret = 0;
+	const struct zip_entry *ze, **files = NULL, **slots = NULL;
+	struct sys_queue queues[SYS_MAX_WORKERS];
+	struct sys_worker workers[SYS_MAX_WORKERS];
+	unsigned int i, first, n = zip_count(), nfiles = 0, per;
+	long ncpu;
+	int nw, started;
+	struct timespec t;
+	enum { T_MOUNT, T_DIRS, T_EXTRACT, T_SYNC, T_UMOUNT, T_MAX };
+	unsigned long lap[T_MAX] = { 0 };
+#ifdef RECOVERY_BUILD
+	int do_umount = 1, fd;
+#endif
+
+	for (i = 0; i < n; i++)
+		if (!strncmp(zip_entry_at(i)->name, "system/", 7))
+			break;
+	if (i == n) {
 #ifndef RECOVERY_BUILD
 		rprint("No system/ dir in zip, skipping.");
 #endif
 		return 0;
 	}
+	first = i;
+
+	/* Directories are made up front, by sys_make_dirs */
+	if (!(files = malloc(n * sizeof(*files))) ||
+		!(slots = malloc(n * sizeof(*slots))) ||
+		!(man = malloc(n * sizeof(*man)))) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	memset(man, 0xff, n * sizeof(*man));
+	for (; i < n; i++) {
+		ze = zip_entry_at(i);
+		if (!strncmp(ze->name, "system/", 7) &&
+			ze->name[ze->namelen - 1] != '/')
+			files[nfiles++] = ze;
+	}
+	qsort(files, nfiles, sizeof(*files), sys_cmp_size);
 
+	ncpu = sysconf(_SC_NPROCESSORS_CONF);
+	nw = ncpu < 1 ? 1 : ncpu > SYS_MAX_WORKERS ? SYS_MAX_WORKERS : ncpu;
+	if (nw > nfiles)
+		nw = nfiles ? nfiles : 1;
+	per = (nfiles + nw - 1) / nw;
+	for (i = 0; i < nw; i++) {
+		pthread_mutex_init(&queues[i].lock, NULL);
+		queues[i].ents = slots + i * per;
+		queues[i].head = queues[i].tail = 0;
+	}
+	for (i = 0; i < nfiles; i++) {
+		struct sys_queue *q = &queues[i % nw];
+		q->ents[q->tail++] = files[i];
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
 #ifdef RECOVERY_BUILD
 	mkdir("/system", 0755);
 	if (mount(SYSTEMPART, "/system", "ext4",
 		MS_NOATIME | MS_NODEV | MS_NODIRATIME, "")) {
 		if (errno != EBUSY) {
 			rprint("Couldn't mount system!");
-			return (void *)(-(long)errno);
+			ret = -errno;
+			goto out_queues;
 		}
 		do_umount = 0;
 	}
 #endif
 
-	do {
-		char *scan;
-		ret = unzGetCurrentFileInfo(zip, NULL, namebuf, 256,
-			NULL, 0, NULL, 0);
-		if (ret == UNZ_END_OF_LIST_OF_FILE)
-			break;
-		else if (ret != UNZ_OK) {
-			rprint("Can't get file info!");
-			ret = -EIO;
-			goto out_close;
-		}
-		if (strncmp(namebuf, "system/", 7))
+	lap[T_MOUNT] = sys_lap(&t);
+
+	if (ret = sys_make_dirs(first, n))
+		goto out_umount;
+#ifdef SYSTEM_MANIFEST
+	sys_read_manifest();
+#endif
+	lap[T_DIRS] = sys_lap(&t);
+
+	/* We're worker 0 */
+	for (i = 0; i < nw; i++) {
+		workers[i].queues = queues;
+		workers[i].id = i;
+		workers[i].nworkers = nw;
+	}
+	for (started = 1; started < nw; started++)
+		if (pthread_create(&workers[started].thread, NULL, sys_worker,
+			&workers[started]))
 			break;
-		/* For now, just skip directories */
-		for (scan = namebuf; *scan; scan++);
-		scan--;
-		if (*scan == '/')
-			continue;
-		ret = unzOpenCurrentFile(zip);
-		if (ret != UNZ_OK) {
-			rprint("Error opening file in zip!");
-			continue;
-		}
-#ifdef RECOVERY_BUILD
-		fd = open(namebuf, O_WRONLY | O_CREAT | O_TRUNC, 0755);
-		if (fd < 0) {
-			rprint("Unable to create file!");
-			continue;
-		}
-		do {
-			int cnt;
-			cnt = rd = unzReadCurrentFile(zip, buf, CHUNK_SIZE);
-			for (wr = 0; cnt > 0; cnt -= wr)
-				wr = write(fd, buf + wr, cnt);
-		} while (rd > 0);
-		if (close(fd))
-			rprint("Error writing file!");
-#else
-		printf("%s: extracting %s\n", __func__, namebuf);
-		do {
-			rd = unzReadCurrentFile(zip, buf, CHUNK_SIZE);
-		} while (rd > 0);
+	ret = (long)sys_worker(&workers[0]);
+	for (i = 1; i < started; i++)
+		pthread_join(workers[i].thread, NULL);
+	sys_close_dirs();
+	lap[T_EXTRACT] = sys_lap(&t);
+#ifdef SYSTEM_MANIFEST
+	sys_write_manifest(files, nfiles);
 #endif
-		if (unzCloseCurrentFile(zip) == UNZ_CRCERROR)
-			rprint("CRC error!");
-	} while (unzGoToNextFile(zip) == UNZ_OK);
+	sys_report();
 
 #if defined(RECOVERY_BUILD) && defined(TW_SELINUX_HACK)
 	fd = open("/system/etc/sec_config", O_RDONLY);
@@ -112,16 +663,41 @@ void *unpack_system(void *arg) {
 	}
 #endif
 
+#ifdef RECOVERY_BUILD
+	/* Wait for the workers' write-back once, for the whole filesystem */
+#ifdef __NR_syncfs
+	if ((fd = open("/system", O_RDONLY | O_DIRECTORY)) >= 0) {
+		syscall(__NR_syncfs, fd);
+		close(fd);
+	}
+#endif
+#endif
+	lap[T_SYNC] = sys_lap(&t);
+
+out_umount:
 #ifdef RECOVERY_BUILD
 	if (do_umount) umount("/system");
 #endif
-	rprint("Unpacked system files");
+	lap[T_UMOUNT] = sys_lap(&t);
+	if (!ret) {
+		/* Not for the UI; recovery keeps our stdout in its log */
+		printf("%s: mount %lu ms, dirs %lu ms, extract %lu ms, "
+			"sync %lu ms, umount %lu ms\n", __func__, lap[T_MOUNT],
+			lap[T_DIRS], lap[T_EXTRACT], lap[T_SYNC],
+			lap[T_UMOUNT]);
+		rprint("Unpacked system files");
+	}
 
-out_close:
-	unzClose(zip);
+#ifdef RECOVERY_BUILD
+out_queues:
+#endif
+	for (i = 0; i < nw; i++)
+		pthread_mutex_destroy(&queues[i].lock);
 out:
 	if (ret)
 		rprint("Error unpacking system files");
-	if (buf) free(buf);
+	free(files);
+	free(slots);
+	free(man);
 	return (void *)ret;
 }
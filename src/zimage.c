@@ -5,56 +5,46 @@
 #include <sys/types.h>
 
 #include "common.h"
-#include <zlib/zlib.h>
-#include <zlib/contrib/minizip/unzip.h>
 
 #include <stdio.h>
 
-#define ZIMAGE_SIZE (8*1024*1024)
 void *unpack_zimage(void *arg) {
 	long ret;
-	int rd = 1, pos;
-	unzFile zip;
-	char *buf;
+	const struct zip_entry *ze;
+	const char *map;
+	char *buf = NULL;
 
-	if (!(buf = malloc(ZIMAGE_SIZE))) return (void *)-ENOMEM;
-
-	if (!(zip = unzOpen(zip_path))) {
-		ret = -ENOENT;
-		rprint("Can't open zip!");
-		goto out_free;
-	}
-	if (unzLocateFile(zip, ZIMAGE, 1) != UNZ_OK) {
+	if (!(ze = zip_find(ZIMAGE))) {
 		ret = -ENOENT;
 		rprint("zImage is missing!");
-		goto out_close;
-	}
-	if (unzOpenCurrentFile(zip) != UNZ_OK) {
-		ret = -EBADF;
-		rprint("Can't open zImage!");
-		goto out_close;
+		goto out_free;
 	}
 
-	for (pos = 0; rd > 0; pos += rd) {
-		rd = unzReadCurrentFile(zip, buf + pos, ZIMAGE_SIZE - pos);
+	/* A stored zImage is used in place; otherwise inflate it directly
+	 * into a buffer of the right size.
+	 */
+	if ((ret = zip_map(ze, &map)) == -EINVAL) {
+		if (!(buf = malloc(ze->usize ? ze->usize : 1))) {
+			ret = -ENOMEM;
+			goto out_free;
+		}
+		ret = zip_extract(ze, buf);
+		map = buf;
 	}
-	if (rd) {
-		ret = -EIO;
+	if (ret == -EBADMSG) {
+		rprint("Corrupt zImage in zip!");
+	} else if (ret) {
 		rprint("Reading zImage failed!");
-		goto out_close;
+		goto out_free;
 	}
 
-	if (unzCloseCurrentFile(zip) == UNZ_CRCERROR)
-		rprint("Corrupt zImage in zip!");
-
-	unzClose(zip);
-	ret = add_zimage(buf, pos);
 	rprint("Unpacked new zImage");
-	return (void *)ret;
+	/* This writes what it can, too; add_ramdisk writes the rest */
+	return (void *)(long)add_zimage((void *)map, ze->usize);
 
-out_close:
-	unzClose(zip);
 out_free:
+	/* Don't leave the ramdisk waiting for us */
+	add_zimage(NULL, 0);
 	free(buf);
 	return (void *)ret;
 }
@@ -0,0 +1,402 @@
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "common.h"
+#include <zlib/zlib.h>
+
+/* Install zip index:
+ * The archive is mmapped once and its central directory parsed into a flat
+ * array of entries, in directory order, plus a hash of the names.  Nothing
+ * changes after zip_index_open, so every thread can look things up without
+ * locking.  Stored members can be used straight from the mapping; deflated
+ * ones are inflated from it, either whole or through a private cursor.
+ * Only stored and deflated members are supported, and no zip64.
+ */
+#define ZIP_EOCD_SIG (0x06054b50)
+#define ZIP_CDIR_SIG (0x02014b50)
+#define ZIP_LOCAL_SIG (0x04034b50)
+#define ZIP_EOCD_LEN (22)
+#define ZIP_CDIR_LEN (46)
+#define ZIP_LOCAL_LEN (30)
+#define ZIP_COMMENT_MAX (0xffff)
+#define ZIP_HOST_UNIX (3) /* "version made by", high byte */
+
+static struct {
+	const uint8_t *map;
+	unsigned long size;
+	int fd; /* kept open for zip_copy */
+	struct zip_entry *ents;
+	unsigned int count, hmask;
+	/* Bucket heads and per-entry chains, as indices; -1 ends a chain */
+	int *hash, *chain;
+	char *names;
+} zi;
+
+struct zip_file {
+	const struct zip_entry *ze;
+	const uint8_t *src;
+	unsigned long left, out;
+	uLong crc;
+	int done;
+	z_stream strm;
+};
+
+static inline uint16_t zip_get16(const uint8_t *p) {
+	return p[0] | (p[1] << 8);
+}
+static inline uint32_t zip_get32(const uint8_t *p) {
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/* FNV-1a */
+static unsigned int zip_hash(const char *name, unsigned int len) {
+	uint32_t h = 2166136261U;
+	while (len--)
+		h = (h ^ (uint8_t)*name++) * 16777619U;
+	return h;
+}
+
+/* zip_index_open:
+ * Map the zip and index its central directory.  Returns 0 or -errno.
+ */
+int zip_index_open(const char *path) {
+	const uint8_t *p, *cd, *end;
+	struct zip_entry *ze;
+	struct stat st;
+	unsigned long cdoff, cdsize;
+	unsigned int i, h, nlen, xlen, clen;
+	char *np;
+	int fd, ret;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return -errno;
+	if (fstat(fd, &st)) {
+		ret = -errno;
+		close(fd);
+		return ret;
+	}
+	if (st.st_size < ZIP_EOCD_LEN) {
+		close(fd);
+		return -EINVAL;
+	}
+	zi.map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (zi.map == MAP_FAILED) {
+		ret = -errno;
+		close(fd);
+		zi.map = NULL;
+		return ret;
+	}
+	zi.size = st.st_size;
+	zi.fd = fd;
+
+	/* The end record is followed by at most 64KB of comment */
+	for (p = zi.map + zi.size - ZIP_EOCD_LEN; ; p--) {
+		if (zip_get32(p) == ZIP_EOCD_SIG &&
+			zip_get16(p + 20) <= zi.map + zi.size - p - ZIP_EOCD_LEN)
+			break;
+		if (p == zi.map ||
+			zi.map + zi.size - p >= ZIP_EOCD_LEN + ZIP_COMMENT_MAX)
+			goto bad;
+	}
+	zi.count = zip_get16(p + 10);
+	cdsize = zip_get32(p + 12);
+	cdoff = zip_get32(p + 16);
+	if (cdoff > zi.size || cdsize > zi.size - cdoff)
+		goto bad;
+
+	for (zi.hmask = 15; zi.hmask < zi.count * 2; zi.hmask = zi.hmask * 2 + 1);
+	zi.ents = calloc(zi.count ? zi.count : 1, sizeof(struct zip_entry));
+	zi.chain = malloc((zi.count ? zi.count : 1) * sizeof(int));
+	zi.hash = malloc((zi.hmask + 1) * sizeof(int));
+	/* Each name is shorter than its directory record */
+	zi.names = malloc(cdsize ? cdsize : 1);
+	if (!zi.ents || !zi.chain || !zi.hash || !zi.names) {
+		ret = -ENOMEM;
+		goto fail;
+	}
+	memset(zi.hash, 0xff, (zi.hmask + 1) * sizeof(int));
+
+	cd = zi.map + cdoff;
+	end = cd + cdsize;
+	np = zi.names;
+	for (i = 0; i < zi.count; i++) {
+		if (end - cd < ZIP_CDIR_LEN || zip_get32(cd) != ZIP_CDIR_SIG)
+			goto bad;
+		nlen = zip_get16(cd + 28);
+		xlen = zip_get16(cd + 30);
+		clen = zip_get16(cd + 32);
+		if (end - cd - ZIP_CDIR_LEN < nlen + xlen + clen)
+			goto bad;
+
+		ze = &zi.ents[i];
+		ze->method = zip_get16(cd + 10);
+		ze->crc = zip_get32(cd + 16);
+		ze->csize = zip_get32(cd + 20);
+		ze->usize = zip_get32(cd + 24);
+		ze->attr = zip_get32(cd + 38);
+		ze->mode = cd[5] == ZIP_HOST_UNIX ? ze->attr >> 16 : 0;
+		ze->off = zip_get32(cd + 42);
+		memcpy(np, cd + ZIP_CDIR_LEN, nlen);
+		np[nlen] = 0;
+		ze->name = np;
+		ze->namelen = nlen;
+		np += nlen + 1;
+		cd += ZIP_CDIR_LEN + nlen + xlen + clen;
+	}
+
+	/* Hash in reverse, so the first of any duplicates wins */
+	for (i = zi.count; i--; ) {
+		h = zip_hash(zi.ents[i].name, zi.ents[i].namelen) & zi.hmask;
+		zi.chain[i] = zi.hash[h];
+		zi.hash[h] = i;
+	}
+	return 0;
+
+bad:
+	ret = -EINVAL;
+fail:
+	free(zi.ents);
+	free(zi.chain);
+	free(zi.hash);
+	free(zi.names);
+	munmap((void *)zi.map, zi.size);
+	close(zi.fd);
+	memset(&zi, 0, sizeof(zi));
+	return ret;
+}
+
+/* zip_find:
+ * Exact, case-sensitive lookup.  Returns NULL if name isn't in the zip.
+ */
+const struct zip_entry *zip_find(const char *name) {
+	unsigned int len = strlen(name);
+	int i;
+
+	if (!zi.hash)
+		return NULL;
+	for (i = zi.hash[zip_hash(name, len) & zi.hmask]; i >= 0;
+		i = zi.chain[i])
+		if (zi.ents[i].namelen == len &&
+			!memcmp(zi.ents[i].name, name, len))
+			return &zi.ents[i];
+	return NULL;
+}
+
+unsigned int zip_count(void) {
+	return zi.count;
+}
+const struct zip_entry *zip_entry_at(unsigned int i) {
+	return i < zi.count ? &zi.ents[i] : NULL;
+}
+
+/* Find a member's data behind its local header, or NULL if it's damaged or
+ * uses an unsupported method.
+ */
+static const uint8_t *zip_data(const struct zip_entry *ze) {
+	const uint8_t *lh;
+	unsigned long data;
+
+	if (ze->off > zi.size || zi.size - ze->off < ZIP_LOCAL_LEN)
+		return NULL;
+	lh = zi.map + ze->off;
+	if (zip_get32(lh) != ZIP_LOCAL_SIG)
+		return NULL;
+	data = ze->off + ZIP_LOCAL_LEN + zip_get16(lh + 26) +
+		zip_get16(lh + 28);
+	if (data > zi.size || ze->csize > zi.size - data)
+		return NULL;
+	if (ze->method == 0 ? ze->csize != ze->usize : ze->method != 8)
+		return NULL;
+	return zi.map + data;
+}
+
+/* zip_map:
+ * Point *data at a stored member, in place.  The mapping is read-only and
+ * lives as long as the process.  Returns 0, -EINVAL if the member isn't
+ * stored (or is damaged), or -EBADMSG if it fails its CRC; *data is still
+ * set in that case.
+ */
+int zip_map(const struct zip_entry *ze, const char **data) {
+	const uint8_t *src;
+
+	if (ze->method != 0 || !(src = zip_data(ze)))
+		return -EINVAL;
+	*data = (const char *)src;
+	if (crc32(crc32(0, Z_NULL, 0), src, ze->usize) != ze->crc)
+		return -EBADMSG;
+	return 0;
+}
+
+/* zip_extract:
+ * Copy or inflate a whole member into dst, which must hold ze->usize bytes.
+ * Deflated members are inflated in a single pass, straight from the mapping.
+ * Returns 0, or -errno (-EBADMSG for a CRC error).
+ */
+int zip_extract(const struct zip_entry *ze, char *dst) {
+	const uint8_t *src;
+	z_stream strm;
+	int zret;
+
+	if (!(src = zip_data(ze)))
+		return -EINVAL;
+	if (ze->method == 0) {
+		memcpy(dst, src, ze->usize);
+	} else {
+		strm.zalloc = Z_NULL;
+		strm.zfree = Z_NULL;
+		strm.opaque = Z_NULL;
+		strm.next_in = (uint8_t *)src;
+		strm.avail_in = ze->csize;
+		if (inflateInit2(&strm, -MAX_WBITS) != Z_OK)
+			return -ENOMEM;
+		strm.next_out = (uint8_t *)dst;
+		strm.avail_out = ze->usize;
+		zret = inflate(&strm, Z_FINISH);
+		inflateEnd(&strm);
+		if (zret != Z_STREAM_END || strm.total_out != ze->usize)
+			return -EIO;
+	}
+	if (crc32(crc32(0, Z_NULL, 0), (uint8_t *)dst, ze->usize) != ze->crc)
+		return -EBADMSG;
+	return 0;
+}
+
+/* zip_copy:
+ * Copy a stored member into fd, at its current offset, without bouncing it
+ * through a buffer: copy_file_range where the kernel has it, else sendfile,
+ * else write() straight from the mapping.  A method that fails as
+ * unsupported isn't tried again; racing workers just find out twice, and
+ * the method only ever moves forward.  src is the member as zip_map gave
+ * it, so the caller has already seen the CRC pass.  Returns 0 or -errno.
+ */
+enum { ZIP_COPY_RANGE, ZIP_COPY_SENDFILE, ZIP_COPY_WRITE };
+static int zip_copy_how = ZIP_COPY_RANGE;
+
+int zip_copy(const struct zip_entry *ze, const char *src, int fd) {
+	unsigned long left = ze->usize;
+	off_t pos = src - (const char *)zi.map;
+	loff_t lpos;
+	long n;
+	int how;
+
+	while (left) {
+		how = __atomic_load_n(&zip_copy_how, __ATOMIC_RELAXED);
+		if (how == ZIP_COPY_RANGE) {
+#ifdef __NR_copy_file_range
+			lpos = pos;
+			n = syscall(__NR_copy_file_range, zi.fd, &lpos, fd, NULL,
+				left, 0);
+			pos = lpos;
+#else
+			n = -1;
+			errno = ENOSYS;
+#endif
+		} else if (how == ZIP_COPY_SENDFILE) {
+			n = sendfile(fd, zi.fd, &pos, left);
+		} else {
+			n = write(fd, (const char *)zi.map + pos, left);
+			if (n > 0)
+				pos += n;
+		}
+
+		if (n < 0 && how != ZIP_COPY_WRITE && (errno == ENOSYS ||
+			errno == EINVAL || errno == EXDEV ||
+			errno == EOPNOTSUPP)) {
+			__atomic_compare_exchange_n(&zip_copy_how, &how, how + 1,
+				0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+			continue;
+		}
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -errno;
+		if (!n)
+			return -EIO;
+		left -= n;
+	}
+	return 0;
+}
+
+/* zip_fopen:
+ * Set up a cursor over a member.  Returns NULL if the member is damaged or
+ * uses an unsupported method.
+ */
+struct zip_file *zip_fopen(const struct zip_entry *ze) {
+	const uint8_t *src;
+	struct zip_file *f;
+
+	if (!(src = zip_data(ze)))
+		return NULL;
+	if (!(f = malloc(sizeof(struct zip_file))))
+		return NULL;
+	f->ze = ze;
+	f->src = src;
+	f->left = ze->csize;
+	f->out = 0;
+	f->crc = crc32(0, Z_NULL, 0);
+	f->done = 0;
+	if (ze->method == 8) {
+		f->strm.zalloc = Z_NULL;
+		f->strm.zfree = Z_NULL;
+		f->strm.opaque = Z_NULL;
+		f->strm.next_in = (uint8_t *)f->src;
+		f->strm.avail_in = f->left;
+		if (inflateInit2(&f->strm, -MAX_WBITS) != Z_OK) {
+			free(f);
+			return NULL;
+		}
+	}
+	return f;
+}
+
+/* zip_fread:
+ * Returns the number of bytes read, 0 at the end of the member, or -errno.
+ */
+long zip_fread(struct zip_file *f, char *buf, unsigned long len) {
+	unsigned long n;
+	int zret;
+
+	if (f->ze->method == 0) {
+		n = f->left < len ? f->left : len;
+		memcpy(buf, f->src, n);
+		f->src += n;
+		f->left -= n;
+	} else {
+		if (f->done || !len)
+			return 0;
+		f->strm.next_out = (uint8_t *)buf;
+		f->strm.avail_out = len;
+		zret = inflate(&f->strm, Z_NO_FLUSH);
+		if (zret == Z_STREAM_END)
+			f->done = 1;
+		else if (zret != Z_OK)
+			return zret == Z_MEM_ERROR ? -ENOMEM : -EIO;
+		n = len - f->strm.avail_out;
+	}
+	f->crc = crc32(f->crc, (uint8_t *)buf, n);
+	f->out += n;
+	return n;
+}
+
+/* zip_fclose:
+ * Returns -EBADMSG if the whole member was read and its CRC is wrong.
+ */
+int zip_fclose(struct zip_file *f) {
+	int ret = 0;
+
+	if (f->out == f->ze->usize && f->crc != f->ze->crc)
+		ret = -EBADMSG;
+	if (f->ze->method == 8)
+		inflateEnd(&f->strm);
+	free(f);
+	return ret;
+}
@@ -0,0 +1,189 @@
+/* Round-trip check for bdeflate.c
+ * Compresses a few synthetic inputs with bdeflate, inflates them with zlib
+ * and compares.  The compressor's state is allocated dirty, as a real malloc
+ * may hand it back, and the inputs are shaped so streams mix static and
+ * dynamic blocks.  Exits non-zero on the first mismatch.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void *dirty_malloc(size_t n) {
+	void *p = malloc(n);
+
+	if (p)
+		memset(p, 0xa5, n);
+	return p;
+}
+#define malloc(n) dirty_malloc(n)
+#include "src/bdeflate.c"
+#undef malloc
+
+static char *out;
+static unsigned long out_len, out_size;
+
+static int emit(const char *buf, unsigned long len) {
+	if (out_size - out_len < len) {
+		out_size = (out_len + len) * 2;
+		if (!(out = realloc(out, out_size)))
+			return -ENOMEM;
+	}
+	memcpy(out + out_len, buf, len);
+	out_len += len;
+	return 0;
+}
+
+static uint32_t seed = 1;
+static unsigned int rnd(unsigned int n) {
+	seed = seed * 1103515245 + 12345;
+	return (seed >> 8) % n;
+}
+
+/* Words from a small vocabulary, skewed towards the first few */
+static void gen_text(uint8_t *p, unsigned long len) {
+	static const char *words[] = {
+		"the ", "init ", "service ", "on ", "property:", "sys.",
+		"boot_completed=1\n", "class ", "main\n", "user ", "system\n",
+		"group ", "seclabel ", "u:r:", "write ", "/proc/", "chmod ",
+		"0644 ", "mkdir ", "/data/", "restart ", "oneshot\n",
+	};
+	const char *w;
+	unsigned long i = 0;
+
+	while (i < len) {
+		w = words[rnd(rnd(22) + 1)];
+		while (*w && i < len)
+			p[i++] = *w++;
+	}
+}
+
+/* Literals and matches drawn to fit the static code, so a short block of
+ * these isn't worth a dynamic header.  Matches reach back before p, so it
+ * needs that much input before it.
+ */
+static void gen_flat(uint8_t *p, unsigned long len) {
+	unsigned long i = 0, n, d;
+	unsigned int s;
+
+	while (i < len) {
+		s = rnd(400);
+		if (rnd(1000) < 780) {
+			p[i++] = s < 288 ? s / 2 : s - 144;
+			continue;
+		}
+		s = rnd(23);
+		n = bd_len_base[s] + rnd(1 << bd_len_extra[s]);
+		s = rnd(30);
+		d = bd_dist_base[s] + rnd(1 << bd_dist_extra[s]);
+		for (; n-- && i < len; i++)
+			p[i] = p[i - d];
+	}
+}
+
+static void gen_noise(uint8_t *p, unsigned long len) {
+	while (len--)
+		*p++ = rnd(256);
+}
+
+/* Walk the blocks with inflate(Z_BLOCK), noting each block's type.  mix
+ * requires both static and dynamic blocks.
+ */
+static int check(const char *name, const uint8_t *in, unsigned long len,
+		int mix) {
+	struct bdeflate *bd;
+	z_stream strm;
+	uint8_t *dec;
+	unsigned long bit;
+	unsigned int types[4] = { 0 }, hdr;
+	long ret;
+	int zret;
+
+	out_len = 0;
+	if (!(bd = bdeflate_init(emit)) ||
+		bdeflate_write(bd, (const char *)in, len) ||
+		(ret = bdeflate_finish(bd)) < 0 ||
+		(unsigned long)ret != out_len) {
+		printf("%s: compression failed\n", name);
+		return 1;
+	}
+	if (!(dec = malloc(len + 1)))
+		return 1;
+
+	memset(&strm, 0, sizeof(strm));
+	if (inflateInit2(&strm, 16 + MAX_WBITS) != Z_OK)
+		return 1;
+	strm.next_in = (uint8_t *)out;
+	strm.avail_in = out_len;
+	strm.next_out = dec;
+	strm.avail_out = len + 1;
+	do {
+		zret = inflate(&strm, Z_BLOCK);
+		if (zret == Z_OK && strm.data_type & 128 &&
+			!(strm.data_type & 64)) {
+			bit = strm.total_in * 8 - (strm.data_type & 7);
+			hdr = ((uint8_t)out[bit / 8] |
+				(uint8_t)out[bit / 8 + 1] << 8) >> (bit % 8);
+			types[(hdr >> 1) & 3]++;
+		}
+	} while (zret == Z_OK);
+	inflateEnd(&strm);
+
+	printf("%-6s %8lu -> %8lu  stored %u, static %u, dynamic %u  ", name,
+		len, out_len, types[0], types[1], types[2]);
+	if (zret != Z_STREAM_END || strm.total_out != len ||
+		memcmp(dec, in, len)) {
+		printf("MISMATCH (zlib %d)\n", zret);
+		free(dec);
+		return 1;
+	}
+	free(dec);
+	if (mix && (!types[1] || !types[2])) {
+		printf("no static/dynamic mix\n");
+		return 1;
+	}
+	printf("ok\n");
+	return 0;
+}
+
+int main(void) {
+	static const unsigned long tail[] = { 0, 300, 5000, 40000 };
+	unsigned long len, i, j;
+	uint8_t *in;
+	int ret = 0;
+
+	if (!(in = malloc(4 << 20)))
+		return 1;
+
+	/* Alone */
+	gen_text(in, 1 << 20);
+	ret |= check("text", in, 1 << 20, 0);
+	ret |= check("short", in, 300, 0);
+	gen_noise(in, 100000);
+	ret |= check("noise", in, 100000, 0);
+
+	/* Text, then short runs of static-shaped data and noise between more
+	 * text, then a tail that may be a block of its own.  Text and noise
+	 * also give the flat runs their history.
+	 */
+	for (i = 0; i < sizeof(tail) / sizeof(*tail); i++) {
+		gen_text(in, 300000);
+		for (len = 300000, j = 0; j < 6; j++) {
+			gen_flat(in + len, 15000);
+			len += 15000;
+			if (j & 1) {
+				gen_noise(in + len, 20000);
+				len += 20000;
+			} else {
+				gen_text(in + len, 40000);
+				len += 40000;
+			}
+		}
+		gen_text(in + len, tail[i]);
+		len += tail[i];
+		ret |= check("mixed", in, len, 1);
+	}
+
+	free(in);
+	free(out);
+	return ret;
+}
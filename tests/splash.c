@@ -0,0 +1,187 @@
+/* Splash row encoder check and benchmark
+ * Encodes synthetic 720x1280 images with splash.c's row code and with the
+ * plain one-pixel loop it replaces, fails unless the blocks are byte-identical,
+ * and reports the best of RUNS timings for each.  Without NEON or SSE2 both
+ * sides are the same loop.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "src/splash.c"
+
+#define RUNS (20)
+#define W (SCREENX)
+#define H (SCREENY)
+
+/* rle_compress_pixels as it was, one pixel at a time */
+static void scalar_pixels(struct rle_state *st, int len) {
+	struct rle_block *bl;
+	const uint8_t *buf = st->linebuf;
+	unsigned short color;
+
+	rle_compress_pad(st, st->mincol, 0);
+	bl = &st->blocks[st->blocknr];
+	while (len--) {
+		color = to565(buf[0], buf[1], buf[2]);
+		if (color != bl->color || bl->count == 65535)
+			bl = rle_compress_next_block(st, color);
+		bl->count++;
+		buf += 4;
+	}
+	rle_compress_pad(st, st->maxcol, 0);
+}
+
+/* Encode img as generate_splash would, finishing the chain the same way */
+static int encode(struct rle_state *st, const uint8_t *img,
+		void (*pixels)(struct rle_state *, int)) {
+	int y;
+
+	if (rle_compress_init(st) || !(st->linebuf = malloc(4 * W)))
+		return -ENOMEM;
+	st->x = W;
+	st->y = H;
+	st->mincol = st->maxcol = st->minrow = st->maxrow = 0;
+	for (y = 0; y < H; y++) {
+		/* The row code packs in place, so give it a copy */
+		memcpy(st->linebuf, img + y * W * 4, W * 4);
+		pixels(st, W);
+	}
+	if (st->blocks[st->blocknr].count)
+		st->blocknr++;
+	st->tail->len = st->blocknr * sizeof(struct rle_block);
+	return st->err;
+}
+
+static double now_ms(void) {
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000.0 + t.tv_nsec / 1000000.0;
+}
+
+static double bench(const uint8_t *img,
+		void (*pixels)(struct rle_state *, int)) {
+	struct rle_state st;
+	double t, best = 1e9;
+	int i;
+
+	for (i = 0; i < RUNS; i++) {
+		t = now_ms();
+		encode(&st, img, pixels);
+		t = now_ms() - t;
+		rle_compress_free(&st);
+		if (t < best)
+			best = t;
+	}
+	return best;
+}
+
+static int same(const struct file_chunk *a, const struct file_chunk *b,
+		unsigned long *blocks) {
+	const char *pa, *pb;
+	unsigned long la, lb, n;
+
+	/* The chunks are sized the same way, but compare as one stream */
+	*blocks = 0;
+	pa = a ? a->buf : NULL;
+	pb = b ? b->buf : NULL;
+	la = a ? a->len : 0;
+	lb = b ? b->len : 0;
+	while (a && b) {
+		n = la < lb ? la : lb;
+		if (memcmp(pa, pb, n))
+			return 0;
+		*blocks += n / sizeof(struct rle_block);
+		pa += n, la -= n;
+		pb += n, lb -= n;
+		if (!la && (a = a->next))
+			pa = a->buf, la = a->len;
+		if (!lb && (b = b->next))
+			pb = b->buf, lb = b->len;
+	}
+	return !a && !b;
+}
+
+static uint32_t seed = 1;
+static unsigned int rnd(void) {
+	seed = seed * 1103515245 + 12345;
+	return seed >> 8;
+}
+
+static void gen_flat(uint8_t *img) {
+	memset(img, 0, W * H * 4);
+}
+
+/* A flat background, with a noisy 400x400 logo in the middle */
+static void gen_logo(uint8_t *img) {
+	int x, y;
+	uint8_t *p;
+
+	for (y = 0; y < H; y++) {
+		for (x = 0; x < W; x++) {
+			p = img + (y * W + x) * 4;
+			if (abs(x - W / 2) < 200 && abs(y - H / 2) < 200 &&
+				rnd() % 4) {
+				p[0] = rnd();
+				p[1] = rnd();
+				p[2] = rnd();
+			} else {
+				p[0] = 0x20;
+				p[1] = 0x40;
+				p[2] = 0x80;
+			}
+			p[3] = 0xff;
+		}
+	}
+}
+
+/* Every pixel its own block: the worst case for the run search */
+static void gen_noise(uint8_t *img) {
+	int i;
+
+	for (i = 0; i < W * H * 4; i++)
+		img[i] = rnd();
+}
+
+int main(void) {
+	static const struct {
+		const char *name;
+		void (*gen)(uint8_t *);
+	} imgs[] = {
+		{ "flat", gen_flat },
+		{ "logo", gen_logo },
+		{ "noise", gen_noise },
+	};
+	struct rle_state a, b;
+	unsigned long blocks = 0;
+	unsigned int i;
+	uint8_t *img;
+	int ret = 0, ok;
+
+#if defined(RLE_NEON)
+	printf("row code: NEON\n");
+#elif defined(RLE_SSE2)
+	printf("row code: SSE2\n");
+#else
+	printf("row code: scalar\n");
+#endif
+	if (!(img = malloc(W * H * 4)))
+		return 1;
+	for (i = 0; i < sizeof(imgs) / sizeof(*imgs); i++) {
+		imgs[i].gen(img);
+		ok = !encode(&a, img, scalar_pixels) &&
+			!encode(&b, img, rle_compress_pixels) &&
+			same(a.head, b.head, &blocks);
+		rle_compress_free(&a);
+		rle_compress_free(&b);
+		printf("%-6s %7lu blocks  scalar %.2f ms, splash.c %.2f ms  %s\n",
+			imgs[i].name, blocks, bench(img, scalar_pixels),
+			bench(img, rle_compress_pixels),
+			ok ? "identical" : "MISMATCH");
+		ret |= !ok;
+	}
+	free(img);
+	return ret;
+}